@@ -22,9 +22,14 @@ ifeq ($(TARGET_ARCH),x86)
 else ifeq ($(TARGET_ARCH),arm)
     LOCAL_SRC_FILES += $(LIBKECCAK_PATH)/SnP/KeccakP-1600/Optimized32biAsmARM/KeccakP-1600-inplace-32bi-armv7a-le-gcc.s
     LOCAL_C_INCLUDES += $(LOCAL_PATH)/$(LIBKECCAK_PATH)/SnP/KeccakP-1600/Optimized32biAsmARM/
+    # only the NEON pattern scan is built with NEON, as it's used only once cpufeatures reports NEON support
+    LOCAL_SRC_FILES := $(filter-out src/bytepatternneon.cpp,$(LOCAL_SRC_FILES)) src/bytepatternneon.cpp.neon
+    LOCAL_STATIC_LIBRARIES += cpufeatures
 endif
 LOCAL_SRC_FILES += $(LIBKECCAK_PATH)/Constructions/KeccakSponge.c
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/$(LIBKECCAK_PATH)/Common/ $(LOCAL_PATH)/$(LIBKECCAK_PATH)/Constructions/ \
     $(LOCAL_PATH)/$(LIBKECCAK_PATH)/SnP/
 
 include $(BUILD_SHARED_LIBRARY)
+
+$(call import-module,android/cpufeatures)
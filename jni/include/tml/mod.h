@@ -20,11 +20,22 @@ private:
     friend class StaticHookManager;
 
     struct QueuedHook {
-        std::string lib, sym;
+        std::string lib;
+        unsigned int sym; // the interned symbol name
         void* func;
         void** org;
     };
 
+    struct QueuedObserver {
+        std::string lib;
+        unsigned int sym; // the interned symbol name
+        void* dispatch;
+        void** original;
+        HookObserverArray** observers;
+        void* callback;
+        bool post;
+    };
+
     ModLoader* loader;
     std::unique_ptr<ModResources> resources;
     ModMeta meta;
@@ -34,16 +45,26 @@ private:
     bool initialized = false;
     std::vector<std::unique_ptr<ModLoadedCode>> loadedCode;
     std::vector<QueuedHook> queuedHooks;
+    std::vector<QueuedObserver> queuedObservers;
 
     void load();
     void init();
+    void unload();
     bool isLoaded() const { return loaded; }
 
-    void queueHook(const std::string& lib, const std::string& sym, void* func, void** orig);
+    void queueHook(const std::string& lib, const char* sym, size_t symLength, void* func, void** orig);
+
+    void queueObserver(const std::string& lib, const char* sym, size_t symLength, void* dispatch, void** original,
+                       HookObserverArray** observers, void* callback, bool post);
 
 public:
     Mod(ModLoader* loader, std::unique_ptr<ModResources> resources);
 
+    /**
+     * Creates the mod using already known metadata, without reading the package.yaml file from the resources.
+     */
+    Mod(ModLoader* loader, std::unique_ptr<ModResources> resources, ModMeta const& meta);
+
     /**
      * Returns a pointer to the ModLoader class which has loaded this mod.
      */
@@ -84,6 +105,59 @@ public:
      */
     ModHook* hook(const char* str, void* func, void** orig);
 
+    /**
+     * Hooks a function by patching its code rather than the pointers used to call it, so that also the direct calls
+     * from within its own library are redirected. Returns a pointer using which you can remove the hook.
+     *
+     * The code of a function can only be patched until the mods are initialized (ie. from the mod's init), as the game
+     * might be running it later; afterwards this throws a std::runtime_error, unless the function is already hooked
+     * inline.
+     */
+    ModHook* hookInline(void* lib, const char* str, void* func, void** orig);
+
+    /**
+     * Hooks a MCPE function by patching its code (see the other hookInline overload).
+     */
+    ModHook* hookInline(const char* str, void* func, void** orig);
+
+    /**
+     * Hooks the function at the specified address by patching its code. For Thumb functions the lowest bit of the
+     * address has to be set.
+     */
+    ModHook* hookInlineAt(void* function, void* func, void** orig);
+
+    /**
+     * Hooks a function only for the calls made by the specified library (eg. your own native library, or another
+     * mod's one), leaving the calls made by all of the other libraries untouched.
+     */
+    ModHook* hookImportsOf(void* lib, const char* str, void* func, void** orig);
+
+    /**
+     * Hooks a virtual function by patching the entry with the specified index in the specified vtable (eg.
+     * "_ZTV6Entity"), so that only the calls on objects of that class are redirected. If allInheriting is set, the
+     * entry is patched also in the vtables of the derived classes which don't override the function.
+     */
+    ModHook* hookVirtual(void* lib, const char* vtable, unsigned int index, void* func, void** orig,
+                         bool allInheriting = false);
+
+    /**
+     * Hooks a virtual function of a MCPE class (see the other hookVirtual overload).
+     */
+    ModHook* hookVirtual(const char* vtable, unsigned int index, void* func, void** orig, bool allInheriting = false);
+
+    /**
+     * Finds the first occurrence of a byte pattern (eg. "48 8B ?? ?? E8", where ?? matches any byte) in the code of
+     * the specified library, so that functions which aren't exported can be found without hard-coding their address.
+     * Returns null if the pattern wasn't found; throws a std::runtime_error if the pattern is malformed. The result
+     * can be passed to hookInlineAt (with the lowest bit set for Thumb code).
+     */
+    void* findPattern(void* lib, const char* pattern);
+
+    /**
+     * Finds the first occurrence of a byte pattern in MCPE's code (see the other findPattern overload).
+     */
+    void* findPattern(const char* pattern);
+
     /**
      * Removes a hook.
      */
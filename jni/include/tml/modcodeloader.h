@@ -21,6 +21,16 @@ public:
     virtual ~ModLoadedCode() { }
     virtual void init() = 0;
     virtual void onMinecraftInitialized(MinecraftClient* minecraft) = 0;
+
+    /**
+     * Unloads the code; the object is destroyed right after this call. This is used when the mod is being reloaded.
+     */
+    virtual void unload() { }
+
+    /**
+     * Returns the dlopen handle of the native library this code was loaded from, or null if it isn't native code.
+     */
+    virtual void* getNativeLibrary() const { return nullptr; }
     // virtual void callCallback(std::string name, scripting::UTypeList args);
 
 };
@@ -29,6 +39,14 @@ class ModCodeLoader {
 
 public:
     virtual ~ModCodeLoader() { }
+
+    /**
+     * Does the work needed to load the code which doesn't depend on any other mod being loaded (eg. extracting and
+     * verifying files). This is called before loadCode, possibly on another thread and concurrently with preparing
+     * the code of other mods. Returns false if the code can't be loaded.
+     */
+    virtual bool prepareCode(Mod& mod, std::string path) { return true; }
+
     virtual std::unique_ptr<ModLoadedCode> loadCode(Mod& mod, std::string path) = 0;
 
 };
@@ -4,6 +4,8 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <mutex>
 #include <jni.h>
 #include <android/asset_manager.h>
 #include "log.h"
@@ -16,6 +18,32 @@ class ModResources;
 class ModCodeLoader;
 class NativeModCodeLoader;
 class HookManager;
+class ModHeapTracker;
+class ModManifestIndex;
+
+/**
+ * The call statistics of an instrumented hook (or of all of the instrumented hooks of a mod).
+ */
+struct ModHookStats {
+    static const int HISTOGRAM_BUCKETS = 32;
+
+    Mod* mod;
+    std::string symbol; // empty for the per-mod totals
+    unsigned long long callCount = 0;
+    unsigned long long totalTimeNs = 0;
+    unsigned long long latencyHistogram[HISTOGRAM_BUCKETS] = {}; // calls by floor(log2(duration in ns))
+};
+
+/**
+ * The heap allocations made by the code of a mod. Only the frees made by the mod itself are counted.
+ */
+struct ModHeapStats {
+    Mod* mod;
+    unsigned long long allocatedBytes = 0, freedBytes = 0;
+    unsigned long long allocationCount = 0, freeCount = 0;
+
+    long long getLiveBytes() const { return (long long) (allocatedBytes - freedBytes); }
+};
 
 class ModLoader : public LogPrinter {
 
@@ -23,15 +51,25 @@ private:
     std::map<std::string, std::pair<Mod*, std::unique_ptr<ModCodeLoader>>> loaders;
     std::map<std::string, std::map<ModVersion, std::unique_ptr<Mod>>> mods;
     std::vector<std::pair<Mod*, std::unique_ptr<LogPrinter>>> logPrinters;
+    std::recursive_mutex logPrintersMutex; // the mods may be logging from other threads while printers are added
 
-    bool loadMod(Mod& mod);
+    std::unique_ptr<Mod> createMod(std::string const& path, bool isDirectory);
+    void registerMod(std::unique_ptr<Mod> mod);
+    bool resolveDependencies(Mod& mod, std::map<Mod*, int>& state, std::vector<Mod*>& stack);
+    std::vector<Mod*> getLoadOrder(std::vector<Mod*> const& mods);
+    void loadMods(std::vector<Mod*> const& mods);
     void initMod(Mod& mod);
+    void addToInitOrder(Mod& mod, std::vector<Mod*>& order, std::set<Mod*>& visited);
+    void applyQueuedHooks(std::vector<Mod*> const& mods);
+    void trackModHeap(Mod& mod);
 
 protected:
     std::string internalDir;
     std::string modDataStoragePath;
     Log loaderLog;
     HookManager* hookManager;
+    ModHeapTracker* heapTracker = nullptr; // only created once heap tracking is enabled
+    ModManifestIndex* manifestIndex;
     void* mcpeLib;
     AAssetManager* assetManager;
     long long assetsLastModifyTime;
@@ -72,6 +110,53 @@ public:
     void resolveDependenciesAndLoad();
     void updateHookManagerLoadedLibs();
 
+    /**
+     * Unloads the code of the specified (already loaded) mod and loads it again, re-extracting the native libraries
+     * if they have changed. The hooks of the mod are removed and installed again at the same positions in the hook
+     * chains. Mods depending on the reloaded mod are not reloaded, so they must not keep pointers into its code.
+     */
+    void reloadMod(Mod& mod);
+
+    /**
+     * Enables the call count and latency instrumentation of the hooks installed from now on. This has a small cost
+     * on every call of the instrumented hooks; when disabled, hooks are installed without any overhead.
+     */
+    void setHookInstrumentationEnabled(bool enabled);
+
+    /**
+     * Returns the statistics of each of the installed instrumented hooks.
+     */
+    std::vector<ModHookStats> getHookStats() const;
+
+    /**
+     * Returns the statistics of all of the installed instrumented hooks summed up per the mod that installed them.
+     */
+    std::vector<ModHookStats> getModHookStats() const;
+
+    /**
+     * Prints the per-mod and per-hook statistics of the instrumented hooks to the log.
+     */
+    void dumpHookStats();
+
+    /**
+     * Enables counting the heap allocations made by the native code of each mod. Only the calls made from the mods'
+     * libraries are hooked, so this has no effect on the game's own allocations.
+     */
+    void setHeapTrackingEnabled(bool enabled);
+
+    /**
+     * Returns the heap allocation counters of each of the mods tracked since heap tracking has been enabled. The
+     * allocation rate can be computed from the difference between two calls.
+     */
+    std::vector<ModHeapStats> getModHeapStats() const;
+
+    /**
+     * Enables recording the time spent in each of the loading phases (also enabled by creating a file named
+     * trace_startup in the internal directory). The timeline is written to startup_trace.json in the internal
+     * directory in the Chrome trace event format once the mods are loaded.
+     */
+    void setTracingEnabled(bool enabled);
+
     std::string const& getModDataStoragePath() { return modDataStoragePath; }
 
 };
@@ -76,8 +76,12 @@ private:
     std::vector<ModCode> code;
     std::vector<ModDependency> dependencies;
     bool supportsMultiversion = false;
+    bool dependenciesResolved = false; // set by the ModLoader once it has resolved the dependencies of all mods
+
+    ModMeta() { }
 
     friend class ModLoader;
+    friend class ModManifestIndex;
 
 public:
     ModMeta(ModResources& resources);
@@ -127,9 +131,9 @@ public:
     bool hasDeclaredMultiversionSupport() const { return supportsMultiversion; }
 
     /**
-     * Returns if all of the mod's dependencies were resolved.
+     * Returns if all of the mod's dependencies (and their dependencies) were resolved.
      */
-    bool areAllDependenciesResolved() const;
+    bool areAllDependenciesResolved() const { return dependenciesResolved; }
 
 };
 
@@ -5,6 +5,8 @@
 #include <map>
 #include <set>
 #include <memory>
+#include <mutex>
+#include <functional>
 #include <android/asset_manager.h>
 
 struct zip;
@@ -128,4 +130,32 @@ public:
 
 };
 
+/**
+ * Creates the actual resources object only once the mod's files are first accessed. This is used for the mods whose
+ * metadata is already known, so that their archives don't have to be opened on startup.
+ */
+class DeferredModResources : public ModResources {
+
+protected:
+    std::function<ModResources* ()> factory;
+    std::unique_ptr<ModResources> resources;
+    std::mutex mutex;
+
+    ModResources& get();
+
+public:
+    DeferredModResources(std::function<ModResources* ()> factory) : factory(std::move(factory)) { }
+
+    virtual std::unique_ptr<std::istream> open(const std::string& path) { return get().open(path); }
+
+    virtual bool contains(const std::string& path) { return get().contains(path); }
+
+    virtual std::vector<DirectoryFile> list(const std::string& path) { return get().list(path); }
+
+    virtual long long getSize(const std::string& path) { return get().getSize(path); }
+
+    virtual long long getLastModifyTime(const std::string& path) { return get().getLastModifyTime(path); }
+
+};
+
 }
@@ -1,17 +1,87 @@
 #pragma once
 
+#include <cstddef>
+
 namespace tml {
 
 class Mod;
 
+/**
+ * The observers of a hooked function: a contiguous array of the pre observers followed by the post observers. The
+ * array is never modified once published; a changed set of observers is published as a new array.
+ */
+struct HookObserverArray {
+    size_t preCount, postCount;
+    void** pre;
+    void** post;
+};
+
+/**
+ * Calls all of the observers of a function and the original function once. Only a single dispatcher is installed
+ * per symbol no matter how many mods observe it, so the observers of all of the mods have to use the same signature.
+ */
+template <typename Tag, typename Ret, typename... Args>
+struct ObserverDispatcher {
+    static Ret (*original)(Args...);
+    static HookObserverArray* observers;
+
+    static Ret dispatch(Args... args) {
+        HookObserverArray* obs = __atomic_load_n(&observers, __ATOMIC_ACQUIRE);
+        for (size_t i = 0; i < obs->preCount; i++)
+            ((void (*)(Args...)) obs->pre[i])(args...);
+        Ret ret = original(args...);
+        for (size_t i = 0; i < obs->postCount; i++)
+            ((void (*)(Args...)) obs->post[i])(args...);
+        return ret;
+    }
+};
+template <typename Tag, typename... Args>
+struct ObserverDispatcher<Tag, void, Args...> {
+    static void (*original)(Args...);
+    static HookObserverArray* observers;
+
+    static void dispatch(Args... args) {
+        HookObserverArray* obs = __atomic_load_n(&observers, __ATOMIC_ACQUIRE);
+        for (size_t i = 0; i < obs->preCount; i++)
+            ((void (*)(Args...)) obs->pre[i])(args...);
+        original(args...);
+        for (size_t i = 0; i < obs->postCount; i++)
+            ((void (*)(Args...)) obs->post[i])(args...);
+    }
+};
+template <typename Tag, typename Ret, typename... Args>
+Ret (*ObserverDispatcher<Tag, Ret, Args...>::original)(Args...);
+template <typename Tag, typename Ret, typename... Args>
+HookObserverArray* ObserverDispatcher<Tag, Ret, Args...>::observers;
+template <typename Tag, typename... Args>
+void (*ObserverDispatcher<Tag, void, Args...>::original)(Args...);
+template <typename Tag, typename... Args>
+HookObserverArray* ObserverDispatcher<Tag, void, Args...>::observers;
+
+template <typename Tag, typename Ret, typename Observer>
+struct ObserverDispatcherOf;
+template <typename Tag, typename Ret, typename... Args>
+struct ObserverDispatcherOf<Tag, Ret, void (*)(Args...)> {
+    typedef ObserverDispatcher<Tag, Ret, Args...> type;
+};
+
 class StaticHookManager {
 
 public:
 
-    static Mod* currentMod;
+    /**
+     * Returns the mod whose code is being loaded on the calling thread (the static hooks are registered while the
+     * library's static constructors run), or null.
+     */
+    static Mod* getCurrentMod();
+
+    static void setCurrentMod(Mod* mod);
 
     static void registerHook(const char* sym, void* hook, void** org);
 
+    static void registerObserver(const char* sym, void* dispatch, void** original, HookObserverArray** observers,
+                                 void* observer, bool post);
+
     struct RegisterHook {
 
         RegisterHook(const char* sym, void* hook, void** org) { registerHook(sym, hook, org); }
@@ -29,6 +99,17 @@ public:
 
     };
 
+    template <typename Dispatcher>
+    struct RegisterObserver {
+
+        template <typename T>
+        RegisterObserver(const char* sym, T observer, bool post) {
+            registerObserver(sym, (void*) &Dispatcher::dispatch, (void**) &Dispatcher::original,
+                             &Dispatcher::observers, (void*) observer, post);
+        }
+
+    };
+
 };
 
 }
@@ -67,3 +148,15 @@ ret _TStaticHook_##iname::_hook(args)
 #define TInstanceHook(ret, sym, type, args...) TInstanceHook2(sym, ret, sym, type, args)
 #define TStaticHook2(iname, ret, sym, type, args...) _TStaticDefHook(iname, sym, ret, type, args)
 #define TStaticHook(ret, sym, type, args...) TStaticHook2(sym, ret, sym, type, args)
+
+// Observers are called before (pre) or after (post) the hooked function with its arguments (for instance methods the
+// first argument is the object), without having to call the original function themselves.
+#define _TObserver(post, iname, ret, sym, args...) \
+struct _TObserver_##iname { static void _observer(args); }; \
+static tml::StaticHookManager::RegisterObserver<tml::ObserverDispatcherOf<_TObserver_##iname, ret, decltype(&_TObserver_##iname::_observer)>::type> _TRObserver_##iname (#sym, &_TObserver_##iname::_observer, post); \
+void _TObserver_##iname::_observer(args)
+
+#define TPreObserver2(iname, ret, sym, args...) _TObserver(false, iname, ret, sym, args)
+#define TPreObserver(ret, sym, args...) TPreObserver2(sym##_pre, ret, sym, args)
+#define TPostObserver2(iname, ret, sym, args...) _TObserver(true, iname, ret, sym, args)
+#define TPostObserver(ret, sym, args...) TPostObserver2(sym##_post, ret, sym, args)
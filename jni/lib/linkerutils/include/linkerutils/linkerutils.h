@@ -1,4 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+
 void* dlsym_weak(void* handle, const char* symbol);
-void dlsym_replace(void* handle, const char* symbol, void* with);
\ No newline at end of file
+void dlsym_replace(void* handle, const char* symbol, void* with);
+void dlsym_foreach(void* handle, void (*callback)(void* userData, const char* name, void* addr, size_t size),
+                   void* userData);
\ No newline at end of file
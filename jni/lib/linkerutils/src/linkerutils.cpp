@@ -29,6 +29,10 @@
 #include <android/log.h>
 #include <linkerutils/linker.h>
 
+#ifndef DT_GNU_HASH
+#define DT_GNU_HASH 0x6ffffef5
+#endif
+
 static Elf_Sym* soinfo_elf_lookup(soinfo* si, unsigned hash, const char* name) {
     Elf_Sym* symtab = si->symtab;
     const char* strtab = si->strtab;
@@ -66,6 +70,90 @@ static unsigned elfhash(const char* _name) {
     return h;
 }
 
+static uint32_t gnuhash(const char* _name) {
+    const unsigned char* name = (const unsigned char*) _name;
+    uint32_t h = 5381;
+
+    while (*name)
+        h = (h << 5) + h + *name++;
+    return h;
+}
+
+static const uint32_t* soinfo_get_gnu_hash(soinfo* si) {
+    if (si->dynamic == NULL)
+        return NULL;
+    for (Elf_Dyn* d = si->dynamic; d->d_tag != DT_NULL; d++) {
+        if (d->d_tag == DT_GNU_HASH)
+            return reinterpret_cast<const uint32_t*>(si->base + d->d_un.d_ptr);
+    }
+    return NULL;
+}
+
+/* Looks up the symbol using the DT_GNU_HASH table: the bloom filter rejects most of the symbols which aren't defined
+   in the library, and the hash stored in the chain lets us skip strcmp for all but (almost always) the matching
+   symbol. */
+static Elf_Sym* soinfo_gnu_lookup(soinfo* si, const uint32_t* gnu_hash, uint32_t hash, const char* name) {
+    uint32_t nbucket = gnu_hash[0];
+    uint32_t symndx = gnu_hash[1];
+    uint32_t maskwords = gnu_hash[2];
+    uint32_t shift2 = gnu_hash[3];
+    const uintptr_t* bloom = reinterpret_cast<const uintptr_t*>(&gnu_hash[4]);
+    const uint32_t* bucket = reinterpret_cast<const uint32_t*>(&bloom[maskwords]);
+    const uint32_t* chain = &bucket[nbucket];
+    const unsigned bloom_bits = sizeof(uintptr_t) * 8;
+
+    if (nbucket == 0 || maskwords == 0)
+        return NULL;
+    uintptr_t word = bloom[(hash / bloom_bits) & (maskwords - 1)];
+    uintptr_t mask = ((uintptr_t) 1 << (hash % bloom_bits)) | ((uintptr_t) 1 << ((hash >> shift2) % bloom_bits));
+    if ((word & mask) != mask)
+        return NULL;
+
+    uint32_t n = bucket[hash % nbucket];
+    if (n < symndx)
+        return NULL;
+    while (true) {
+        Elf_Sym* s = si->symtab + n;
+        uint32_t chain_hash = chain[n - symndx];
+        if (((chain_hash ^ hash) >> 1) == 0 && strcmp(si->strtab + s->st_name, name) == 0) {
+            switch (ELF_ST_BIND(s->st_info)) {
+                case STB_GLOBAL:
+                case STB_WEAK:
+                    if (s->st_shndx != SHN_UNDEF)
+                        return s;
+            }
+        }
+        if (chain_hash & 1)
+            break;
+        n++;
+    }
+    return NULL;
+}
+
+/* Returns the number of entries of the dynamic symbol table. Without DT_HASH (and so nchain) this has to be
+   determined from the GNU hash table: the symbol with the highest index is in the last chain of the highest bucket. */
+static size_t soinfo_symbol_count(soinfo* si) {
+    const uint32_t* gnu_hash = soinfo_get_gnu_hash(si);
+    if (gnu_hash == NULL)
+        return si->nchain;
+    uint32_t nbucket = gnu_hash[0];
+    uint32_t symndx = gnu_hash[1];
+    uint32_t maskwords = gnu_hash[2];
+    const uintptr_t* bloom = reinterpret_cast<const uintptr_t*>(&gnu_hash[4]);
+    const uint32_t* bucket = reinterpret_cast<const uint32_t*>(&bloom[maskwords]);
+    const uint32_t* chain = &bucket[nbucket];
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < nbucket; i++) {
+        if (bucket[i] > last)
+            last = bucket[i];
+    }
+    if (last < symndx)
+        return symndx;
+    while ((chain[last - symndx] & 1) == 0)
+        last++;
+    return last + 1;
+}
+
 /* This is used by dlsym(3).  It performs symbol lookup only within the
    specified soinfo object and not in any of its dependencies.
 
@@ -76,6 +164,9 @@ static unsigned elfhash(const char* _name) {
    Object Dependencies" in breadth first search order.
  */
 Elf_Sym* dlsym_handle_lookup(soinfo* si, const char* name) {
+    const uint32_t* gnu_hash = soinfo_get_gnu_hash(si);
+    if (gnu_hash != NULL)
+        return soinfo_gnu_lookup(si, gnu_hash, gnuhash(name), name);
     return soinfo_elf_lookup(si, elfhash(name), name);
 }
 
@@ -105,4 +196,21 @@ void dlsym_replace(void* handle, const char* symbol, void* with) {
         return;
     }
     __android_log_print(ANDROID_LOG_ERROR, "dlsym-replace", "Failed when looking up %s\n", symbol);
-}
\ No newline at end of file
+}
+
+void dlsym_foreach(void* handle, void (*callback)(void* userData, const char* name, void* addr, size_t size),
+                   void* userData) {
+    soinfo* si = reinterpret_cast<soinfo*>(handle);
+    size_t count = soinfo_symbol_count(si);
+    for (size_t i = 1; i < count; i++) {
+        Elf_Sym* s = si->symtab + i;
+        if (s->st_shndx == SHN_UNDEF)
+            continue;
+        switch (ELF_ST_BIND(s->st_info)) {
+            case STB_GLOBAL:
+            case STB_WEAK:
+                callback(userData, si->strtab + s->st_name, reinterpret_cast<void*>(s->st_value + si->base),
+                         s->st_size);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#include "bytepattern.h"
+
+#include <cstring>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__arm__)
+#include <cpu-features.h>
+#endif
+
+using namespace tml;
+
+static int parseHexDigit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+BytePattern::BytePattern(const char* pattern) : text(pattern) {
+    const char* p = pattern;
+    while (true) {
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        if (p[0] == '?') {
+            p += (p[1] == '?' ? 2 : 1);
+            bytes.push_back(0);
+            fixed.push_back(false);
+        } else {
+            int hi = parseHexDigit(p[0]);
+            int lo = (hi >= 0 ? parseHexDigit(p[1]) : -1);
+            if (lo < 0)
+                throw std::runtime_error("Invalid byte pattern: " + text);
+            p += 2;
+            bytes.push_back((unsigned char) ((hi << 4) | lo));
+            fixed.push_back(true);
+        }
+        if (*p != ' ' && *p != '\0')
+            throw std::runtime_error("Invalid byte pattern: " + text);
+    }
+    firstAnchor = bytes.size();
+    for (size_t i = 0; i < bytes.size(); i++) {
+        if (fixed[i]) {
+            if (firstAnchor == bytes.size())
+                firstAnchor = i;
+            lastAnchor = i;
+        }
+    }
+    if (firstAnchor == bytes.size())
+        throw std::runtime_error("Byte pattern without any fixed bytes: " + text);
+}
+
+bool BytePattern::matches(const unsigned char* at) const {
+    for (size_t i = 0; i < bytes.size(); i++) {
+        if (fixed[i] && at[i] != bytes[i])
+            return false;
+    }
+    return true;
+}
+
+const unsigned char* BytePattern::findScalar(const unsigned char* start, const unsigned char* end) const {
+    if ((size_t) (end - start) < bytes.size())
+        return nullptr;
+    const unsigned char* last = end - bytes.size(); // the last address a match can start at
+    const unsigned char* p = start;
+    while (p <= last) {
+        const unsigned char* c = (const unsigned char*) memchr(p + firstAnchor, bytes[firstAnchor],
+                                                               (size_t) (last - p) + 1);
+        if (c == nullptr)
+            return nullptr;
+        p = c - firstAnchor;
+        if (matches(p))
+            return p;
+        p++;
+    }
+    return nullptr;
+}
+
+const unsigned char* BytePattern::find(const unsigned char* start, const unsigned char* end) const {
+#if defined(__arm__)
+    // not every ARMv7 CPU has NEON, so only the NEON scan itself is built with it (see Android.mk)
+    if ((android_getCpuFeatures() & ANDROID_CPU_ARM_FEATURE_NEON) != 0)
+        return findNeon(start, end);
+#endif
+    if ((size_t) (end - start) < bytes.size())
+        return nullptr;
+    const unsigned char* last = end - bytes.size();
+    const unsigned char* p = start;
+    // compare 16 candidate positions at once against both of the anchors, and only check the full pattern at the
+    // positions where both of them match; the loads never go past end, as lastAnchor < size()
+#if defined(__SSE2__)
+    __m128i firstVec = _mm_set1_epi8((char) bytes[firstAnchor]);
+    __m128i lastVec = _mm_set1_epi8((char) bytes[lastAnchor]);
+    for ( ; last - p >= 15; p += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (p + firstAnchor));
+        __m128i b = _mm_loadu_si128((const __m128i*) (p + lastAnchor));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, firstVec),
+                                                                            _mm_cmpeq_epi8(b, lastVec)));
+        while (mask != 0) {
+            const unsigned char* candidate = p + __builtin_ctz(mask);
+            if (matches(candidate))
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return findScalar(p, end);
+}
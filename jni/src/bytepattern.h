@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace tml {
+
+/**
+ * A sequence of bytes with wildcards, used to find functions which aren't exported by their code. The pattern is
+ * written as space separated hex bytes, where "??" (or "?") matches any byte, eg. "48 8B ?? ?? E8".
+ */
+class BytePattern {
+
+private:
+    std::string text;
+    std::vector<unsigned char> bytes;
+    std::vector<bool> fixed; // false for the wildcards
+    // the two fixed bytes checked first when searching for a match (the first and the last one)
+    size_t firstAnchor, lastAnchor;
+
+    const unsigned char* findScalar(const unsigned char* start, const unsigned char* end) const;
+    const unsigned char* findNeon(const unsigned char* start, const unsigned char* end) const;
+
+public:
+    /**
+     * Parses the specified pattern; throws a std::runtime_error if it is malformed or contains only wildcards.
+     */
+    BytePattern(const char* pattern);
+
+    std::string const& getText() const { return text; }
+
+    size_t size() const { return bytes.size(); }
+
+    /**
+     * Checks if the pattern matches the bytes at the specified address (which must be readable for size() bytes).
+     */
+    bool matches(const unsigned char* at) const;
+
+    /**
+     * Returns the first address in the [start, end) range at which the pattern matches, or null if there is none.
+     */
+    const unsigned char* find(const unsigned char* start, const unsigned char* end) const;
+
+};
+
+}
@@ -0,0 +1,33 @@
+#include "bytepattern.h"
+
+// built with NEON enabled (see Android.mk), and only called by BytePattern::find once the CPU is known to support it
+#if defined(__arm__)
+#include <arm_neon.h>
+
+using namespace tml;
+
+const unsigned char* BytePattern::findNeon(const unsigned char* start, const unsigned char* end) const {
+    if ((size_t) (end - start) < bytes.size())
+        return nullptr;
+    const unsigned char* last = end - bytes.size();
+    const unsigned char* p = start;
+    // the same anchor comparison as the SSE2 scan in BytePattern::find
+    uint8x16_t firstVec = vdupq_n_u8(bytes[firstAnchor]);
+    uint8x16_t lastVec = vdupq_n_u8(bytes[lastAnchor]);
+    for ( ; last - p >= 15; p += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(p + firstAnchor), firstVec),
+                                 vceqq_u8(vld1q_u8(p + lastAnchor), lastVec));
+        uint64x2_t eq64 = vreinterpretq_u64_u8(eq);
+        if ((vgetq_lane_u64(eq64, 0) | vgetq_lane_u64(eq64, 1)) == 0)
+            continue;
+        unsigned char lanes[16];
+        vst1q_u8(lanes, eq);
+        for (int i = 0; i < 16; i++) {
+            if (lanes[i] != 0 && matches(p + i))
+                return p + i;
+        }
+    }
+    return findScalar(p, end);
+}
+
+#endif
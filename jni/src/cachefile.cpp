@@ -0,0 +1,74 @@
+#include "cachefile.h"
+
+#include <cstdio>
+#include <cstdint>
+#include "fileutil.h"
+
+using namespace tml;
+
+CacheFileWriter::CacheFileWriter(std::string const& path, int version) : path(path) {
+    FileUtil::createDirs(FileUtil::getParent(path));
+    file = fopen((path + ".tmp").c_str(), "w");
+    if (file != nullptr)
+        write(version);
+}
+
+CacheFileWriter::~CacheFileWriter() {
+    if (file != nullptr) {
+        fclose(file);
+        remove((path + ".tmp").c_str());
+    }
+}
+
+void CacheFileWriter::write(const void* data, size_t size) {
+    if (file == nullptr || size == 0)
+        return;
+    if (fwrite(data, size, 1, file) != 1)
+        failed = true;
+}
+
+void CacheFileWriter::writeString(std::string const& str) {
+    write((uint32_t) str.length());
+    write(str.data(), str.length());
+}
+
+bool CacheFileWriter::commit() {
+    if (file == nullptr)
+        return false;
+    bool success = (fflush(file) == 0 && !failed);
+    fclose(file);
+    file = nullptr;
+    if (success)
+        success = (rename((path + ".tmp").c_str(), path.c_str()) == 0);
+    if (!success)
+        remove((path + ".tmp").c_str());
+    return success;
+}
+
+CacheFileReader::CacheFileReader(std::string const& path, int version) {
+    file = fopen(path.c_str(), "r");
+    int fileVersion = -1;
+    if (file != nullptr && (!read(fileVersion) || fileVersion != version)) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+CacheFileReader::~CacheFileReader() {
+    if (file != nullptr)
+        fclose(file);
+}
+
+bool CacheFileReader::read(void* data, size_t size) {
+    if (file == nullptr)
+        return false;
+    return size == 0 || fread(data, size, 1, file) == 1;
+}
+
+bool CacheFileReader::readString(std::string& str) {
+    uint32_t len;
+    if (!read(len) || len > 64 * 1024)
+        return false;
+    str.resize(len);
+    return len == 0 || read(&str[0], len);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <cstdio>
+
+namespace tml {
+
+/**
+ * Writes a simple versioned binary cache file. The data is written to a temporary file which replaces the target file
+ * only after a successful commit(), so a crash while writing can never leave a partially written cache behind.
+ */
+class CacheFileWriter {
+
+private:
+    std::string path;
+    FILE* file;
+    bool failed = false;
+
+public:
+    CacheFileWriter(std::string const& path, int version);
+
+    ~CacheFileWriter();
+
+    bool isOpen() const { return file != nullptr; }
+
+    void write(const void* data, size_t size);
+
+    template <typename T>
+    void write(T const& val) { write(&val, sizeof(T)); }
+
+    void writeString(std::string const& str);
+
+    /**
+     * Finishes writing the file and replaces the old cache file with it. Returns false on failure.
+     */
+    bool commit();
+
+};
+
+/**
+ * Reads a cache file written by CacheFileWriter. If the file doesn't exist or its version doesn't match, isValid() will
+ * return false.
+ */
+class CacheFileReader {
+
+private:
+    FILE* file;
+
+public:
+    CacheFileReader(std::string const& path, int version);
+
+    ~CacheFileReader();
+
+    bool isValid() const { return file != nullptr; }
+
+    bool read(void* data, size_t size);
+
+    template <typename T>
+    bool read(T& val) { return read(&val, sizeof(T)); }
+
+    bool readString(std::string& str);
+
+};
+
+}
@@ -0,0 +1,54 @@
+#include "codepool.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace tml;
+
+CodePool CodePool::instance;
+
+void* CodePool::allocate(size_t size, size_t alignment) {
+    std::lock_guard<std::mutex> lock (mutex);
+    size_t padding = (alignment - ((uintptr_t) current % alignment)) % alignment;
+    if (current == nullptr || padding + size > remaining) {
+        size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+        size_t allocSize = (size + pageSize - 1) / pageSize * pageSize;
+        void* mem = mmap(nullptr, allocSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return nullptr;
+        current = (char*) mem;
+        remaining = allocSize;
+        padding = 0;
+    }
+    void* ret = current + padding;
+    current += padding + size;
+    remaining -= padding + size;
+    return ret;
+}
+
+void CodePool::write(void* dest, const void* code, size_t size) {
+    std::lock_guard<std::mutex> lock (mutex);
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) dest & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t) dest + size + pageSize - 1) & ~(pageSize - 1);
+    bool hasCode = false;
+    for (uintptr_t page = start; page < end; page += pageSize) {
+        if (executablePages.count(page) > 0)
+            hasCode = true;
+    }
+    // the code already on the page might be running right now, so it has to stay executable during the write
+    if (hasCode && mprotect((void*) start, end - start, PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+        throw std::runtime_error("Failed to make the code pool writable");
+    memcpy(dest, code, size);
+    if (mprotect((void*) start, end - start, PROT_READ | PROT_EXEC) != 0)
+        throw std::runtime_error("Failed to make the code pool executable");
+    for (uintptr_t page = start; page < end; page += pageSize)
+        executablePages.insert(page);
+    flushCache(dest, size);
+}
+
+void CodePool::flushCache(void* start, size_t size) {
+    __builtin___clear_cache((char*) start, (char*) start + size);
+}
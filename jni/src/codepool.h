@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+
+namespace tml {
+
+/**
+ * Hands out small blocks of executable memory for the code generated at runtime (thunks, trampolines). The memory is
+ * never freed, as we can't know if some thread isn't still executing it.
+ *
+ * The pages are never left writable: they are mapped read-write, and made read-only and executable once the code is
+ * written to them. Only code belongs here; data written at runtime must be allocated separately.
+ */
+class CodePool {
+
+private:
+    std::mutex mutex;
+    char* current = nullptr;
+    size_t remaining = 0;
+    std::unordered_set<uintptr_t> executablePages; // the pages which already contain code
+
+public:
+    static CodePool instance;
+
+    /**
+     * Reserves a block of memory for code, which has to be filled in using write(). Returns null on failure.
+     */
+    void* allocate(size_t size, size_t alignment = 16);
+
+    /**
+     * Writes the code of a block returned by allocate(). Throws a std::runtime_error if the memory can't be written.
+     */
+    void write(void* dest, const void* code, size_t size);
+
+    /**
+     * Makes sure the instruction cache sees the code written to the specified range.
+     */
+    static void flushCache(void* start, size_t size);
+
+};
+
+}
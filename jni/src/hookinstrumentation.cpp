@@ -0,0 +1,228 @@
+#include "hookinstrumentation.h"
+
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "codepool.h"
+
+using namespace tml;
+
+#if defined(__i386__) || defined(__arm__)
+#define TML_HAS_INSTRUMENTATION
+#endif
+
+#ifdef TML_HAS_INSTRUMENTATION
+
+#ifdef __i386__
+// the stubs call the functions below with an unknown stack alignment
+#define INSTRUMENTATION_CALLBACK extern "C" __attribute__((visibility("hidden"), force_align_arg_pointer))
+#else
+#define INSTRUMENTATION_CALLBACK extern "C" __attribute__((visibility("hidden")))
+#endif
+
+extern "C" void tml_instr_enter();
+extern "C" void tml_instr_exit();
+
+#if defined(__i386__)
+// entered from a thunk with the HookInstrumentation pushed on top of the caller's return address
+asm(".pushsection .text\n"
+    ".align 16\n"
+    ".hidden tml_instr_enter\n"
+    ".globl tml_instr_enter\n"
+    "tml_instr_enter:\n"
+    "    push %ecx\n"
+    "    push %edx\n"
+    "    push %eax\n"
+    "    lea 16(%esp), %eax\n" // the address of the return address
+    "    push %eax\n"
+    "    pushl 16(%esp)\n" // the HookInstrumentation
+    "    call tml_instr_on_enter\n"
+    "    add $8, %esp\n"
+    "    mov %eax, 12(%esp)\n" // replace the HookInstrumentation with the target, so that ret jumps to it
+    "    pop %eax\n"
+    "    pop %edx\n"
+    "    pop %ecx\n"
+    "    ret\n"
+    ".align 16\n"
+    ".hidden tml_instr_exit\n"
+    ".globl tml_instr_exit\n"
+    "tml_instr_exit:\n"
+    "    push %eax\n"
+    "    push %edx\n"
+    "    call tml_instr_on_exit\n"
+    "    mov %eax, %ecx\n"
+    "    pop %edx\n"
+    "    pop %eax\n"
+    "    jmp *%ecx\n"
+    ".popsection\n");
+#elif defined(__arm__)
+// entered from a thunk with the HookInstrumentation in ip
+asm(".pushsection .text\n"
+    ".align 4\n"
+    ".arm\n"
+    ".hidden tml_instr_enter\n"
+    ".globl tml_instr_enter\n"
+    ".type tml_instr_enter, %function\n"
+    "tml_instr_enter:\n"
+    "    push {r0-r3, ip, lr}\n"
+    "    mov r0, ip\n"
+    "    add r1, sp, #20\n" // the address of the saved lr
+    "    bl tml_instr_on_enter\n"
+    "    mov ip, r0\n"
+    "    pop {r0-r3}\n"
+    "    add sp, sp, #4\n"
+    "    pop {lr}\n"
+    "    bx ip\n"
+    ".hidden tml_instr_exit\n"
+    ".globl tml_instr_exit\n"
+    ".type tml_instr_exit, %function\n"
+    "tml_instr_exit:\n"
+    "    push {r0-r3}\n"
+    "    bl tml_instr_on_exit\n"
+    "    mov ip, r0\n"
+    "    pop {r0-r3}\n"
+    "    bx ip\n"
+#ifdef __thumb__
+    ".thumb\n"
+#endif
+    ".popsection\n");
+#endif
+
+namespace {
+
+struct ShadowStack {
+    static const size_t MAX_DEPTH = 256;
+
+    struct Entry {
+        HookInstrumentation* info;
+        void* returnAddress;
+        long long startTime;
+    };
+    size_t depth;
+    Entry entries[MAX_DEPTH];
+};
+
+pthread_key_t shadowStackKey;
+pthread_once_t shadowStackKeyOnce = PTHREAD_ONCE_INIT;
+
+void destroyShadowStack(void* stack) {
+    munmap(stack, sizeof(ShadowStack));
+}
+
+void createShadowStackKey() {
+    pthread_key_create(&shadowStackKey, destroyShadowStack);
+}
+
+ShadowStack* getShadowStack() {
+    ShadowStack* stack = (ShadowStack*) pthread_getspecific(shadowStackKey);
+    if (stack == nullptr) {
+        // not using malloc, as it might be one of the instrumented functions
+        void* mem = mmap(nullptr, sizeof(ShadowStack), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return nullptr;
+        stack = (ShadowStack*) mem;
+        stack->depth = 0;
+        pthread_setspecific(shadowStackKey, stack);
+    }
+    return stack;
+}
+
+long long getTimeNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void recordCall(HookCallStats& stats, long long duration) {
+    if (duration < 0)
+        duration = 0;
+    int bucket = (duration > 0 ? 63 - __builtin_clzll((unsigned long long) duration) : 0);
+    if (bucket >= HookCallStats::HISTOGRAM_BUCKETS)
+        bucket = HookCallStats::HISTOGRAM_BUCKETS - 1;
+    __atomic_add_fetch(&stats.callCount, 1ULL, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.totalTimeNs, (unsigned long long) duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.histogram[bucket], 1ULL, __ATOMIC_RELAXED);
+}
+
+}
+
+INSTRUMENTATION_CALLBACK void* tml_instr_on_enter(HookInstrumentation* info, void** returnAddress) {
+    ShadowStack* stack = getShadowStack();
+    if (stack != nullptr && stack->depth < ShadowStack::MAX_DEPTH) {
+        ShadowStack::Entry& e = stack->entries[stack->depth++];
+        e.info = info;
+        e.returnAddress = *returnAddress;
+        e.startTime = getTimeNs();
+        *returnAddress = (void*) &tml_instr_exit;
+    } else {
+        // too deep to track the return; still count the call
+        __atomic_add_fetch(&info->stats.callCount, 1ULL, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&info->target, __ATOMIC_ACQUIRE);
+}
+
+INSTRUMENTATION_CALLBACK void* tml_instr_on_exit() {
+    long long endTime = getTimeNs();
+    ShadowStack* stack = (ShadowStack*) pthread_getspecific(shadowStackKey);
+    ShadowStack::Entry& e = stack->entries[--stack->depth];
+    recordCall(e.info->stats, endTime - e.startTime);
+    return e.returnAddress;
+}
+
+#endif
+
+bool HookInstrumentation::isSupported() {
+#ifdef TML_HAS_INSTRUMENTATION
+    return true;
+#else
+    return false;
+#endif
+}
+
+HookInstrumentation* HookInstrumentation::create(void* target) {
+#ifdef TML_HAS_INSTRUMENTATION
+    pthread_once(&shadowStackKeyOnce, createShadowStackKey);
+#if defined(__i386__)
+    const size_t thunkSize = 10;
+    unsigned char* thunk = (unsigned char*) CodePool::instance.allocate(thunkSize);
+#elif defined(__arm__)
+    const size_t thunkSize = 16;
+    uint32_t* thunk = (uint32_t*) CodePool::instance.allocate(thunkSize, 4);
+#endif
+    if (thunk == nullptr)
+        return nullptr;
+    // the stats are updated on every call, so they must not share the cache lines (or even the pages) of the code
+    HookInstrumentation* info = new HookInstrumentation();
+    info->target = target;
+#if defined(__i386__)
+    // push imm32 (info); jmp rel32 (tml_instr_enter)
+    unsigned char code[thunkSize];
+    code[0] = 0x68;
+    uint32_t infoAddr = (uint32_t) (uintptr_t) info;
+    memcpy(&code[1], &infoAddr, 4);
+    code[5] = 0xe9;
+    int32_t rel = (int32_t) ((uintptr_t) &tml_instr_enter - (uintptr_t) (thunk + thunkSize));
+    memcpy(&code[6], &rel, 4);
+#elif defined(__arm__)
+    // ldr ip, [pc, #4]; ldr pc, [pc, #-4]; .word tml_instr_enter; .word info
+    uint32_t code[thunkSize / 4];
+    code[0] = 0xe59fc004;
+    code[1] = 0xe51ff004;
+    code[2] = (uint32_t) (uintptr_t) &tml_instr_enter;
+    code[3] = (uint32_t) (uintptr_t) info;
+#endif
+    try {
+        CodePool::instance.write(thunk, code, thunkSize);
+    } catch (std::exception&) {
+        delete info;
+        return nullptr;
+    }
+    info->thunk = (void*) thunk;
+    return info;
+#else
+    return nullptr;
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+namespace tml {
+
+/**
+ * Call statistics of a single instrumented hook. The fields are updated using atomic operations, so they may be read
+ * at any time (although not as a consistent snapshot).
+ */
+struct HookCallStats {
+    static const int HISTOGRAM_BUCKETS = 32;
+
+    unsigned long long callCount = 0;
+    unsigned long long totalTimeNs = 0; // inclusive of the callees (including the original function)
+    unsigned long long histogram[HISTOGRAM_BUCKETS] = {}; // calls by floor(log2(duration in ns))
+};
+
+/**
+ * A generated thunk that forwards all calls to the target function while recording the time spent in it.
+ *
+ * The thunk records the caller's return address on a per-thread shadow stack and replaces it with a common exit stub,
+ * so C++ exceptions must not propagate through instrumented functions.
+ */
+struct HookInstrumentation {
+    void* target; // read by the entry stub
+    void* thunk;
+    HookCallStats stats;
+
+    /**
+     * Checks if instrumentation thunks can be generated on the current architecture.
+     */
+    static bool isSupported();
+
+    /**
+     * Creates a thunk calling the specified function. Returns null if the thunk couldn't be created. The returned
+     * object is never freed, as a thread might still be running the thunk.
+     */
+    static HookInstrumentation* create(void* target);
+};
+
+}
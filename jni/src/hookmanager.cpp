@@ -1,186 +1,577 @@
 #include "hookmanager.h"
 
-#include <set>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <memory>
+#include <algorithm>
+#include <chrono>
 #include <tml/modloader.h>
+#include <tml/mod.h>
 #include <linkerutils/linker.h>
 #include <linkerutils/linkerutils.h>
+#include "cachefile.h"
+#include "codepool.h"
+#include "tracing.h"
 
 using namespace tml;
 
-HookManager::HookManager(ModLoader* loader) : log(loader, "HookManager") {
-    //
+static const int SECTION_LAYOUT_CACHE_VERSION = 1;
+static const int HOOK_SITE_CACHE_VERSION = 1;
+static const int PATTERN_CACHE_VERSION = 1;
+static const Elf32_Off PATTERN_NOT_FOUND = (Elf32_Off) -1;
+
+#ifndef PT_GNU_RELRO
+#define PT_GNU_RELRO 0x6474e552
+#endif
+
+HookManager::HookManager(ModLoader* loader, std::string cacheDir) : log(loader, "HookManager"), cacheDir(cacheDir) {
+    loadSectionLayoutCache();
+    loadHookSiteCache();
+    loadPatternCache();
+}
+
+HookManager::~HookManager() {
+    if (procMemFd >= 0)
+        close(procMemFd);
 }
 
-int _getline(char** lineptr, size_t* n, FILE* stream) {
-    if (*lineptr == nullptr || *n < 16) {
-        *n = 64;
-        *lineptr = (char*) (*lineptr == nullptr ? malloc(*n) : realloc(*lineptr, *n));
-        if (*lineptr == nullptr)
-            return -1;
+void HookManager::loadSectionLayoutCache() {
+    CacheFileReader reader(cacheDir + "section_layouts", SECTION_LAYOUT_CACHE_VERSION);
+    if (!reader.isValid())
+        return;
+    unsigned int count;
+    if (!reader.read(count))
+        return;
+    for (unsigned int i = 0; i < count; i++) {
+        std::string path;
+        SectionLayoutCacheEntry entry;
+        if (!reader.readString(path) || !reader.read(entry))
+            break;
+        sectionLayoutCache[path] = entry;
     }
-    int c, pos = 0;
-    while ((c = getc(stream)) != EOF) {
-        (*lineptr)[pos++] = (char) c;
-        if (pos >= *n) {
-            *n *= 2;
-            *lineptr = (char*) realloc(*lineptr, *n);
-            if (*lineptr == nullptr)
-                return -1;
+    log.trace("Loaded %i cached section layouts", (int) sectionLayoutCache.size());
+}
+
+void HookManager::saveSectionLayoutCache() {
+    if (!sectionLayoutCacheDirty)
+        return;
+    // drop the libraries which aren't loaded anymore (eg. old mod versions)
+    for (auto it = sectionLayoutCache.begin(); it != sectionLayoutCache.end(); ) {
+        if (librariesByPath.count(it->first) <= 0)
+            it = sectionLayoutCache.erase(it);
+        else
+            it++;
+    }
+    CacheFileWriter writer(cacheDir + "section_layouts", SECTION_LAYOUT_CACHE_VERSION);
+    writer.write((unsigned int) sectionLayoutCache.size());
+    for (auto& e : sectionLayoutCache) {
+        writer.writeString(e.first);
+        writer.write(e.second);
+    }
+    if (writer.commit())
+        sectionLayoutCacheDirty = false;
+    else
+        log.warn("Failed to save the section layout cache");
+}
+
+void HookManager::loadHookSiteCache() {
+    CacheFileReader reader(cacheDir + "hook_sites", HOOK_SITE_CACHE_VERSION);
+    if (!reader.isValid())
+        return;
+    unsigned int count;
+    if (!reader.read(count))
+        return;
+    for (unsigned int i = 0; i < count; i++) {
+        std::string path, name;
+        HookSiteCacheEntry entry;
+        unsigned int libCount;
+        if (!reader.readString(path) || !reader.readString(name) || !reader.read(entry.fileSize) ||
+                !reader.read(entry.fileTimestamp) || !reader.read(entry.symbolOffset) || !reader.read(libCount))
+            return;
+        entry.libraries.resize(libCount);
+        for (HookSiteCacheLibrary& lib : entry.libraries) {
+            unsigned int slotCount;
+            if (!reader.readString(lib.path) || !reader.read(lib.fileSize) || !reader.read(lib.fileTimestamp) ||
+                    !reader.read(slotCount))
+                return;
+            lib.slotOffsets.resize(slotCount);
+            if (slotCount > 0 && !reader.read(lib.slotOffsets.data(), slotCount * sizeof(Elf32_Off)))
+                return;
+        }
+        hookSiteCache[{path, symbolNames.intern(name.c_str(), name.length())}] = std::move(entry);
+    }
+    log.trace("Loaded %i cached symbol patch site lists", (int) hookSiteCache.size());
+}
+
+void HookManager::saveHookSiteCache() {
+    if (!hookSiteCacheDirty)
+        return;
+    for (auto it = hookSiteCache.begin(); it != hookSiteCache.end(); ) {
+        if (librariesByPath.count(it->first.first) <= 0)
+            it = hookSiteCache.erase(it);
+        else
+            it++;
+    }
+    CacheFileWriter writer(cacheDir + "hook_sites", HOOK_SITE_CACHE_VERSION);
+    writer.write((unsigned int) hookSiteCache.size());
+    for (auto& e : hookSiteCache) {
+        HookSiteCacheEntry const& entry = e.second;
+        writer.writeString(e.first.first);
+        writer.writeString(symbolNames.getName(e.first.second));
+        writer.write(entry.fileSize);
+        writer.write(entry.fileTimestamp);
+        writer.write(entry.symbolOffset);
+        writer.write((unsigned int) entry.libraries.size());
+        for (HookSiteCacheLibrary const& lib : entry.libraries) {
+            writer.writeString(lib.path);
+            writer.write(lib.fileSize);
+            writer.write(lib.fileTimestamp);
+            writer.write((unsigned int) lib.slotOffsets.size());
+            writer.write(lib.slotOffsets.data(), lib.slotOffsets.size() * sizeof(Elf32_Off));
         }
-        if (c == '\n')
+    }
+    if (writer.commit())
+        hookSiteCacheDirty = false;
+    else
+        log.warn("Failed to save the hook site cache");
+}
+
+void HookManager::loadPatternCache() {
+    CacheFileReader reader(cacheDir + "patterns", PATTERN_CACHE_VERSION);
+    if (!reader.isValid())
+        return;
+    unsigned int count;
+    if (!reader.read(count))
+        return;
+    for (unsigned int i = 0; i < count; i++) {
+        std::string path, pattern;
+        PatternCacheEntry entry;
+        if (!reader.readString(path) || !reader.readString(pattern) || !reader.read(entry))
+            break;
+        patternCache[{path, pattern}] = entry;
+    }
+    log.trace("Loaded %i cached pattern matches", (int) patternCache.size());
+}
+
+void HookManager::savePatternCache() {
+    if (!patternCacheDirty)
+        return;
+    for (auto it = patternCache.begin(); it != patternCache.end(); ) {
+        if (librariesByPath.count(it->first.first) <= 0)
+            it = patternCache.erase(it);
+        else
+            it++;
+    }
+    CacheFileWriter writer(cacheDir + "patterns", PATTERN_CACHE_VERSION);
+    writer.write((unsigned int) patternCache.size());
+    for (auto& e : patternCache) {
+        writer.writeString(e.first.first);
+        writer.writeString(e.first.second);
+        writer.write(e.second);
+    }
+    if (writer.commit())
+        patternCacheDirty = false;
+    else
+        log.warn("Failed to save the pattern cache");
+}
+
+void HookManager::saveCaches() {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    saveSectionLayoutCache();
+    saveHookSiteCache();
+    savePatternCache();
+}
+
+static void readProcFile(const char* path, std::vector<char>& buffer, size_t& size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(std::string("Failed to open ") + path);
+    if (buffer.size() == 0)
+        buffer.resize(64 * 1024);
+    size = 0;
+    while (true) {
+        if (size + 1 >= buffer.size())
+            buffer.resize(buffer.size() * 2);
+        ssize_t n = read(fd, &buffer[size], buffer.size() - size - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            close(fd);
+            throw std::runtime_error(std::string("Failed to read ") + path);
+        }
+        if (n == 0)
             break;
+        size += n;
+    }
+    close(fd);
+    buffer[size] = '\0';
+}
+
+void HookManager::readMaps() {
+    readProcFile("/proc/self/maps", mapsBuffer, mapsSize);
+}
+
+static bool isTrackedLibraryPath(const char* path, size_t len) {
+    if (len == 0 || path[0] != '/')
+        return false;
+    if (len >= 18 && memcmp(path, "/usr/lib/valgrind/", 18) == 0)
+        return false;
+    if (len >= 5 && memcmp(path, "/dev/", 5) == 0)
+        return false;
+    if (len >= 8 && memcmp(path, "/system/", 8) == 0 &&
+            !(len == 25 && memcmp(path, "/system/lib/libandroid.so", 25) == 0)) {
+        return false;
     }
-    (*lineptr)[pos] = 0;
-    return pos;
+    return true;
+}
+
+static const char* skipMapsField(const char* p, const char* end) {
+    while (p < end && *p == ' ')
+        p++;
+    while (p < end && *p != ' ')
+        p++;
+    return p;
 }
 
 void HookManager::updateLoadedLibs() {
+    TraceScope trace ("updateLoadedLibs");
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    readMaps();
+    if (mapsSize == lastMapsSize && memcmp(mapsBuffer.data(), lastMapsBuffer.data(), mapsSize) == 0) {
+        log.trace("Loaded libs didn't change");
+        return;
+    }
     log.trace("Updating loaded libs...");
-    // first find the libraries
-    FILE* file = fopen("/proc/self/maps", "r");
-    if (file == NULL)
-        throw std::runtime_error("Failed to open /proc/self/maps");
+    mapsGeneration++;
 
-    std::set<std::string> libsToFind;
-    for (auto& e : librariesByPath) {
-        libsToFind.insert(e.first);
-    }
-    char* _name = NULL;
-    size_t len = 0;
-    while (!feof(file)) {
-        long unsigned int start, end;
-        long long unsigned int file_offset;
-        long long inode;
-        char r, w, x, shared;
-        int dev_major, dev_minor;
-        if (fscanf(file, (sizeof(void*) == 8 ? "%16lx-%16lx %c%c%c%c %Lx %x:%x %Lu"
-                                             : "%08lx-%08lx %c%c%c%c %Lx %x:%x %Lu"), &start, &end,
-                   &r, &w, &x, &shared, &file_offset, &dev_major, &dev_minor, &inode) < 9)
-            break;
-        if (_getline(&_name, &len, file) <= 0)
-            break;
-        char* name;
-        {
-            size_t name_start;
-            for (name_start = 0; name_start < len; name_start++) {
-                if (_name[name_start] != ' ')
-                    break;
-            }
-            name = &_name[name_start];
-            ssize_t name_len;
-            for (name_len = (ssize_t) strlen(name) - 1; name_len >= 0; name_len--) {
-                if (name[name_len] != ' ' && name[name_len] != '\n') {
-                    name[name_len + 1] = '\0';
-                    break;
-                }
-            }
-        }
-        if (name[0] != '/')
-            continue; // we're not interested in this map
-        log.trace("Found map: %s %c%c%c %lx-%lx", name, r, w, x, start, end);
-        if (len >= 18 && memcmp(name, "/usr/lib/valgrind/", 18) == 0)
-            continue;
-        if (len >= 5 && memcmp(name, "/dev/", 5) == 0)
+    // group the mappings by the library first, so that only the libraries whose mappings have changed since the last
+    // call are processed; the other mappings (heap, thread stacks) change much more often than the libraries
+    std::unordered_map<std::string, std::vector<LibraryMemMap>> scannedMaps;
+    std::string name;
+    const char* p = mapsBuffer.data();
+    const char* bufferEnd = p + mapsSize;
+    while (p < bufferEnd) {
+        const char* lineEnd = (const char*) memchr(p, '\n', bufferEnd - p);
+        if (lineEnd == nullptr)
+            lineEnd = bufferEnd;
+        const char* line = p;
+        p = lineEnd + 1;
+
+        // format: start-end perms offset dev inode name
+        char* next;
+        unsigned long start = strtoul(line, &next, 16);
+        if (*next != '-')
             continue;
-        if (len >= 8 && memcmp(name, "/system/", 8) == 0 &&
-                !(len >= 25 && memcmp(name, "/system/lib/libandroid.so", 25 + 1) == 0)) {
+        unsigned long end = strtoul(next + 1, &next, 16);
+        if (next + 5 > lineEnd || next[0] != ' ')
             continue;
-        }
-        std::string nameStd(name);
-        if (libsToFind.count(nameStd) > 0)
-            libsToFind.erase(nameStd);
-        if (librariesByPath.count(nameStd) <= 0) {
+        char r = next[1], w = next[2], x = next[3];
+        const char* namePtr = skipMapsField(skipMapsField(skipMapsField(next + 5, lineEnd), lineEnd), lineEnd);
+        while (namePtr < lineEnd && *namePtr == ' ')
+            namePtr++;
+        const char* nameEnd = lineEnd;
+        while (nameEnd > namePtr && nameEnd[-1] == ' ')
+            nameEnd--;
+        size_t len = (size_t) (nameEnd - namePtr);
+        if (!isTrackedLibraryPath(namePtr, len))
+            continue; // we're not interested in this map
+        name.assign(namePtr, len);
+        scannedMaps[name].push_back(LibraryMemMap(start, end, r == 'r', w == 'w', x == 'x'));
+    }
+
+    std::vector<LibraryInfo*> newLibraries;
+    size_t changedCount = 0;
+    for (auto const& e : scannedMaps) {
+        LibraryInfo* li;
+        auto it = librariesByPath.find(e.first);
+        if (it != librariesByPath.end()) {
+            li = it->second;
+            li->mapsGeneration = mapsGeneration;
+            if (li->hasScannedMaps(e.second))
+                continue;
+            changedCount++;
+        } else {
             // this lib is new; add it
-            if (createLibraryInfo(nameStd) == nullptr)
+            if (ignoredPaths.count(e.first) > 0)
+                continue;
+            li = createLibraryInfo(e.first);
+            if (li == nullptr) {
+                ignoredPaths.insert(e.first);
                 continue;
+            }
+            li->mapsGeneration = mapsGeneration;
+            newLibraries.push_back(li);
+        }
+        li->scannedMaps.clear();
+        for (LibraryMemMap const& map : e.second) {
+            log.trace("Found map: %s %c%c%c %lx-%lx", e.first.c_str(), map.r ? 'r' : '-', map.w ? 'w' : '-',
+                      map.x ? 'x' : '-', (unsigned long) map.start, (unsigned long) map.end);
+            li->addMap(map);
+            li->scannedMaps.push_back({map.start, map.end});
         }
-        librariesByPath.at(nameStd)->addMap(LibraryMemMap(start, end, r == 'r', w == 'w', x == 'x'));
     }
     // remove libs we didn't find
-    for (auto& e : libsToFind) {
-        destroyLibraryInfo(librariesByPath.at(e));
+    std::vector<LibraryInfo*> unmappedLibs;
+    for (auto& e : librariesByPath) {
+        if (e.second->mapsGeneration != mapsGeneration)
+            unmappedLibs.push_back(e.second);
     }
+    for (LibraryInfo* li : unmappedLibs)
+        destroyLibraryInfo(li);
+    log.trace("Loaded libs: %i added, %i removed, %i with changed mappings, %i unchanged", (int) newLibraries.size(),
+              (int) unmappedLibs.size(), (int) changedCount,
+              (int) (librariesByPath.size() - newLibraries.size() - changedCount));
+    applySymbolsToLibraries(newLibraries);
+
+    std::swap(mapsBuffer, lastMapsBuffer);
+    std::swap(mapsSize, lastMapsSize);
 }
 
-HookManager::LibraryInfo* HookManager::createLibraryInfo(std::string const& path) {
-    LibraryInfo* li = new LibraryInfo();
-    li->ptr = dlopen(path.c_str(), RTLD_LAZY);
-    if (li->ptr == nullptr) {
-        log.trace("Not creating library info for: %s - error: %s", path.c_str(), dlerror());
-        return nullptr;
-    }
-    li->path = path;
+static HookManager* trackingHookManager;
+static soinfo* linkerListHead; // libdl.so, which is always the first library in the linker's list
+static void* (*dlopenOrg)(const char* filename, int flags);
+static void* (*androidDlopenExtOrg)(const char* filename, int flags, const void* extinfo);
 
-    log.trace("Creating library info for: %s", path.c_str());
-    if (strlen(path.c_str()) <= 0)
-        return nullptr;
+static soinfo* getLinkerListTail() {
+    soinfo* si = linkerListHead;
+    while (si->next != nullptr)
+        si = si->next;
+    return si;
+}
 
-    Elf32_Ehdr header;
-    FILE* file = fopen(path.c_str(), "r");
-    if (file == nullptr)
-        return nullptr;
+static void* dlopenHook(const char* filename, int flags) {
+    soinfo* tail = getLinkerListTail();
+    void* ret = dlopenOrg(filename, flags);
+    if (ret != nullptr)
+        trackingHookManager->onLibraryLoaded(ret, tail);
+    return ret;
+}
 
-    if (fread(&header, sizeof(Elf32_Ehdr), 1, file) != 1) {
-        log.error("Failed to read header!");
-        fclose(file);
-        return nullptr;
+static void* androidDlopenExtHook(const char* filename, int flags, const void* extinfo) {
+    soinfo* tail = getLinkerListTail();
+    void* ret = androidDlopenExtOrg(filename, flags, extinfo);
+    if (ret != nullptr)
+        trackingHookManager->onLibraryLoaded(ret, tail);
+    return ret;
+}
+
+void HookManager::enableLibraryTracking() {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    if (trackingHookManager != nullptr)
+        return;
+    void* libdl = dlopen("libdl.so", RTLD_LAZY);
+    if (libdl == nullptr)
+        throw std::runtime_error("Failed to dlopen libdl.so");
+    trackingHookManager = this;
+    linkerListHead = (soinfo*) libdl;
+    hook(libdl, internSymbol("dlopen"), (void*) dlopenHook, (void**) &dlopenOrg);
+    if (dlsym(libdl, "android_dlopen_ext") != nullptr)
+        hook(libdl, internSymbol("android_dlopen_ext"), (void*) androidDlopenExtHook, (void**) &androidDlopenExtOrg);
+}
+
+/**
+ * Adds the mappings of a library as the linker has created them from the program headers, so that we don't have to
+ * read /proc/self/maps. The ranges the next /proc/self/maps scan is going to see are recorded as well, so that it
+ * doesn't process the library again: only the file-backed part of the segments is listed under the library's path
+ * (the rest of the .bss is anonymous), and the kernel merges the adjacent ranges with the same protection. Should the
+ * ranges differ anyway, the scan just processes the library once more.
+ */
+static void addMapsFromProgramHeaders(HookManager::LibraryInfo* li, soinfo* si) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    auto pageStart = [pageSize](size_t addr) { return addr & ~(pageSize - 1); };
+    auto pageEnd = [pageSize](size_t addr) { return (addr + pageSize - 1) & ~(pageSize - 1); };
+    li->scannedMaps.clear();
+    int lastScannedProt = -1;
+    auto addMap = [li, &lastScannedProt](HookManager::LibraryMemMap const& map, size_t fileEnd) {
+        li->addMap(map);
+        size_t end = std::min(map.end, fileEnd);
+        if (map.start >= end)
+            return;
+        int prot = (map.r ? PROT_READ : 0) | (map.w ? PROT_WRITE : 0) | (map.x ? PROT_EXEC : 0);
+        if (!li->scannedMaps.empty() && li->scannedMaps.back().second == map.start && prot == lastScannedProt)
+            li->scannedMaps.back().second = end;
+        else
+            li->scannedMaps.push_back({map.start, end});
+        lastScannedProt = prot;
+    };
+    size_t relroStart = 0, relroEnd = 0;
+    for (size_t i = 0; i < si->phnum; i++) {
+        if (si->phdr[i].p_type == PT_GNU_RELRO) {
+            relroStart = pageStart(si->load_bias + si->phdr[i].p_vaddr);
+            relroEnd = pageEnd(si->load_bias + si->phdr[i].p_vaddr + si->phdr[i].p_memsz);
+        }
     }
+    for (size_t i = 0; i < si->phnum; i++) {
+        const Elf_Phdr& phdr = si->phdr[i];
+        if (phdr.p_type != PT_LOAD)
+            continue;
+        size_t start = pageStart(si->load_bias + phdr.p_vaddr);
+        size_t end = pageEnd(si->load_bias + phdr.p_vaddr + phdr.p_memsz);
+        size_t fileEnd = pageEnd(si->load_bias + phdr.p_vaddr + phdr.p_filesz);
+        bool r = (phdr.p_flags & PF_R) != 0, w = (phdr.p_flags & PF_W) != 0, x = (phdr.p_flags & PF_X) != 0;
+        if (w && relroStart < end && relroEnd > start) {
+            // the linker makes the relro part of the segment read-only after relocating it
+            size_t s = std::max(start, relroStart), e = std::min(end, relroEnd);
+            if (start < s)
+                addMap(HookManager::LibraryMemMap(start, s, r, w, x), fileEnd);
+            addMap(HookManager::LibraryMemMap(s, e, r, false, x), fileEnd);
+            if (e < end)
+                addMap(HookManager::LibraryMemMap(e, end, r, w, x), fileEnd);
+        } else {
+            addMap(HookManager::LibraryMemMap(start, end, r, w, x), fileEnd);
+        }
+    }
+}
 
-    fseek(file, (long) header.e_shoff, SEEK_SET);
+void HookManager::onLibraryLoaded(void* handle, void* previousTail) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    if (trackingLibraries || libraries.count(handle) > 0)
+        return;
+    trackingLibraries = true;
+    // the linker appends the libraries it loads (the library and its dependencies) to its library list, so these are
+    // exactly the ones after the previous tail; the ones before it (even if we don't know them) weren't loaded now
+    std::vector<LibraryInfo*> newLibraries;
+    bool needsRescan = false;
+    for (soinfo* si = ((soinfo*) previousTail)->next; si != nullptr; si = si->next) {
+        if (libraries.count(si) > 0)
+            continue;
+        size_t len = strnlen(si->name, sizeof(si->name));
+        // the linker only knows the file name, or the path didn't fit into the name field and has been truncated;
+        // the full path has to be read from /proc/self/maps
+        if (len == 0 || si->name[0] != '/' || len >= sizeof(si->name) - 1) {
+            needsRescan = true;
+            continue;
+        }
+        std::string path (si->name, len);
+        if (!isTrackedLibraryPath(path.c_str(), len) || ignoredPaths.count(path) > 0)
+            continue;
+        LibraryInfo* li = createLibraryInfo(path);
+        if (li == nullptr) {
+            ignoredPaths.insert(path);
+            continue;
+        }
+        addMapsFromProgramHeaders(li, si);
+        li->mapsGeneration = mapsGeneration;
+        newLibraries.push_back(li);
+    }
+    log.trace("Registered %i newly loaded libraries", (int) newLibraries.size());
+    applySymbolsToLibraries(newLibraries);
+    if (needsRescan)
+        updateLoadedLibs();
+    trackingLibraries = false;
+}
 
-    char shdr[header.e_shentsize * header.e_shnum];
-    if (fread(&shdr, header.e_shentsize, header.e_shnum, file) != header.e_shnum) {
-        log.error("Failed to read shdr!");
-        fclose(file);
-        return nullptr;
+bool HookManager::readSectionLayout(LibraryInfo* li) {
+    int fd = open(li->path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    size_t size = (size_t) li->fileSize;
+    void* data = (size >= sizeof(Elf32_Ehdr) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log.error("Failed to map %s", li->path.c_str());
+        return false;
     }
-    log.trace("header.e_shnum = %i", header.e_shnum);
 
-    // find strtab
-    char* strtab = nullptr;
-    for (int i = 0; i < header.e_shnum; i++) {
-        Elf32_Shdr& entry = *((Elf32_Shdr*) &shdr[header.e_shentsize * i]);
-        if (entry.sh_type == SHT_STRTAB) {
-            log.trace("Found STRTAB");
-            strtab = new char[entry.sh_size];
-            fseek(file, (long) entry.sh_offset, SEEK_SET);
-            if (fread(strtab, 1, entry.sh_size, file) != entry.sh_size) {
-                log.error("Failed to read STRTAB!");
-                fclose(file);
-                return nullptr;
+    bool success = false;
+    const char* file = (const char*) data;
+    const Elf32_Ehdr& header = *((const Elf32_Ehdr*) file);
+    log.trace("header.e_shnum = %i", header.e_shnum);
+    if (memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_shentsize < sizeof(Elf32_Shdr) ||
+            header.e_shstrndx >= header.e_shnum || header.e_shoff > size ||
+            (size - header.e_shoff) / header.e_shentsize < header.e_shnum) {
+        log.error("Invalid ELF header in %s", li->path.c_str());
+    } else {
+        // only the section name table is needed to find the sections
+        const Elf32_Shdr& strtabEntry = *((const Elf32_Shdr*) &file[header.e_shoff +
+                                                                    header.e_shentsize * header.e_shstrndx]);
+        if (strtabEntry.sh_offset > size || strtabEntry.sh_size > size - strtabEntry.sh_offset) {
+            log.error("Invalid section name table in %s", li->path.c_str());
+        } else {
+            const char* strtab = &file[strtabEntry.sh_offset];
+            for (int i = 0; i < header.e_shnum; i++) {
+                const Elf32_Shdr& entry = *((const Elf32_Shdr*) &file[header.e_shoff + header.e_shentsize * i]);
+                if (entry.sh_name >= strtabEntry.sh_size ||
+                        strnlen(&strtab[entry.sh_name], strtabEntry.sh_size - entry.sh_name) ==
+                                strtabEntry.sh_size - entry.sh_name)
+                    continue;
+                const char* name = &strtab[entry.sh_name];
+                if (strcmp(name, ".got") == 0) {
+                    log.trace("Found .got!");
+                    li->gotOff = entry.sh_addr;
+                    li->gotSize = entry.sh_size;
+                } else if (strcmp(name, ".got.plt") == 0) {
+                    log.trace("Found .got.plt!");
+                    li->gotPltOff = entry.sh_addr;
+                    li->gotPltSize = entry.sh_size;
+                } else if (strcmp(name, ".data.rel.ro") == 0) {
+                    log.trace("Found .data.rel.ro!");
+                    li->dataRelRoOff = entry.sh_addr;
+                    li->dataRelRoSize = entry.sh_size;
+                }
             }
+            success = true;
         }
     }
-    if (strtab == nullptr) {
-        log.error("STRTAB not found!");
-        fclose(file);
+    munmap(data, size);
+    return success;
+}
+
+HookManager::LibraryInfo* HookManager::createLibraryInfo(std::string const& path) {
+    if (path.length() <= 0)
+        return nullptr;
+    // this dlopen call mustn't be handled as a library load, as we're already registering the library
+    bool wasTrackingLibraries = trackingLibraries;
+    trackingLibraries = true;
+    void* ptr = dlopen(path.c_str(), RTLD_LAZY);
+    trackingLibraries = wasTrackingLibraries;
+    if (ptr == nullptr) {
+        log.trace("Not creating library info for: %s - error: %s", path.c_str(), dlerror());
+        return nullptr;
+    }
+    log.trace("Creating library info for: %s", path.c_str());
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        dlclose(ptr);
         return nullptr;
     }
+    std::unique_ptr<LibraryInfo> li (new LibraryInfo());
+    li->ptr = ptr;
+    li->path = path;
+    li->fileSize = st.st_size;
+    li->fileTimestamp = st.st_mtime;
 
-    // find .got, .got.plt and .data.rel.ro
-    for (int i = 0; i < header.e_shnum; i++) {
-        Elf32_Shdr& entry = *((Elf32_Shdr*) &shdr[header.e_shentsize * i]);
-        if (strcmp(&strtab[entry.sh_name], ".got") == 0) {
-            log.trace("Found .got!");
-            li->gotOff = entry.sh_addr;
-            li->gotSize = entry.sh_size;
-        } else if (strcmp(&strtab[entry.sh_name], ".got.plt") == 0) {
-            log.trace("Found .got.plt!");
-            li->gotPltOff = entry.sh_addr;
-            li->gotPltSize = entry.sh_size;
-        } else if (strcmp(&strtab[entry.sh_name], ".data.rel.ro") == 0) {
-            log.trace("Found .data.rel.ro!");
-            li->dataRelRoOff = entry.sh_addr;
-            li->dataRelRoSize = entry.sh_size;
+    auto cacheIt = sectionLayoutCache.find(path);
+    if (cacheIt != sectionLayoutCache.end() && cacheIt->second.fileSize == li->fileSize &&
+            cacheIt->second.fileTimestamp == li->fileTimestamp) {
+        SectionLayoutCacheEntry const& entry = cacheIt->second;
+        li->gotOff = entry.gotOff;
+        li->gotSize = entry.gotSize;
+        li->gotPltOff = entry.gotPltOff;
+        li->gotPltSize = entry.gotPltSize;
+        li->dataRelRoOff = entry.dataRelRoOff;
+        li->dataRelRoSize = entry.dataRelRoSize;
+    } else {
+        if (!readSectionLayout(li.get())) {
+            dlclose(ptr);
+            return nullptr;
         }
+        sectionLayoutCache[path] = {li->fileSize, li->fileTimestamp, li->gotOff, li->gotSize, li->gotPltOff,
+                                    li->gotPltSize, li->dataRelRoOff, li->dataRelRoSize};
+        sectionLayoutCacheDirty = true;
     }
-    fclose(file);
 
-    libraries[li->ptr] = li;
-    librariesByPath[li->path] = li;
-    return li;
+    li->index = (unsigned int) librariesByIndex.size();
+    librariesByIndex.push_back(li.get());
+    liveLibraries.push_back(true);
+    libraries[li->ptr] = li.get();
+    librariesByPath[li->path] = li.get();
+    return li.release();
 }
 
 void HookManager::LibraryInfo::addMap(LibraryMemMap mmap) {
@@ -189,148 +580,1246 @@ void HookManager::LibraryInfo::addMap(LibraryMemMap mmap) {
             return;
     }
     memMaps.push_back(mmap);
-    if (mmap.r && mmap.x && !mmap.w) {
-        if (mprotect((void*) mmap.start, mmap.end - mmap.start, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
-            std::cerr << "mprotect() of code section failed. We have to use a hacky patch to patch code in this lib.\n";
-            memMaps.back().needsHackyPatchToWork = true;
-            mightNeedHackyPatch = true;
-        }
-    } else if (mmap.r && !mmap.x && !mmap.w) {
-        if (mprotect((void*) mmap.start, mmap.end - mmap.start, PROT_READ | PROT_WRITE) != 0) {
-            std::cerr << "mprotect() of data section failed, some stuff might be broken.\n";
-        }
+}
+
+bool HookManager::LibraryInfo::hasScannedMaps(std::vector<LibraryMemMap> const& maps) const {
+    if (maps.size() != scannedMaps.size())
+        return false;
+    for (size_t i = 0; i < maps.size(); i++) {
+        if (maps[i].start != scannedMaps[i].first || maps[i].end != scannedMaps[i].second)
+            return false;
+    }
+    return true;
+}
+
+HookManager::LibraryMemMap* HookManager::LibraryInfo::findMap(size_t addr) {
+    for (auto& map : memMaps) {
+        if (addr >= map.start && addr < map.end)
+            return &map;
     }
+    return nullptr;
 }
 
 void HookManager::destroyLibraryInfo(LibraryInfo* libraryInfo) {
     libraries.erase(libraryInfo->ptr);
     librariesByPath.erase(libraryInfo->path);
+    librariesByIndex[libraryInfo->index] = nullptr;
+    liveLibraries[libraryInfo->index] = false;
+    for (auto it = resolvedSymbols.begin(); it != resolvedSymbols.end(); ) {
+        if (it->first.lib == libraryInfo->ptr)
+            it = resolvedSymbols.erase(it);
+        else
+            it++;
+    }
+    delete libraryInfo;
+}
+
+bool HookManager::LibraryInfo::isPatchableOffset(Elf32_Addr off) const {
+    return (gotOff != 0 && off >= gotOff && off < gotOff + gotSize) ||
+           (gotPltOff != 0 && off >= gotPltOff && off < gotPltOff + gotPltSize) ||
+           (dataRelRoOff != 0 && off >= dataRelRoOff && off < dataRelRoOff + dataRelRoSize);
 }
 
-void HookManager::findSymbolAndAddTo(std::vector<void*>& arr, Elf32_Addr base, Elf32_Addr soSize, Elf32_Addr off,
-                                     Elf32_Addr size, void* sym) {
-    if (off == 0 || off >= soSize)
+template <typename T>
+static void addRelocationsToSlotIndex(HookManager::LibraryInfo* li, soinfo* si, T* rel, size_t count) {
+    if (rel == nullptr)
         return;
-    size = std::min(size, soSize - off);
-    unsigned long addr = base + off + 4;
-    while (addr < base + off + size) {
-        if (*((void**) addr) == sym) {
-            if (hookedSymbolRefs.count((void*) addr) > 0)
-                continue;
-            arr.push_back((void*) addr);
-            hookedSymbolRefs.insert((void*) addr);
+    for (size_t i = 0; i < count; i++, rel++) {
+        if (ELF32_R_TYPE(rel->r_info) == 0 || !li->isPatchableOffset(rel->r_offset))
+            continue;
+        void** slot = (void**) (si->base + rel->r_offset);
+        li->slotIndex[*slot].push_back(slot);
+    }
+}
+
+void HookManager::addSectionToSlotIndex(LibraryInfo* li, Elf32_Off off, Elf32_Off size) {
+    soinfo* si = (soinfo*) li->ptr;
+    if (off == 0 || off >= si->size)
+        return;
+    size = std::min(size, si->size - off);
+    for (unsigned long addr = si->base + off + 4; addr < si->base + off + size; addr += sizeof(void*))
+        li->slotIndex[*((void**) addr)].push_back((void**) addr);
+}
+
+void HookManager::buildSlotIndex(LibraryInfo* li) {
+    // The dynamic relocations tell us exactly which words of the GOT and relro sections the linker has filled in, so
+    // we don't have to look at every single word of them.
+    soinfo* si = (soinfo*) li->ptr;
+#if defined(USE_RELA)
+    addRelocationsToSlotIndex(li, si, si->plt_rela, si->plt_rela_count);
+    addRelocationsToSlotIndex(li, si, si->rela, si->rela_count);
+#else
+    addRelocationsToSlotIndex(li, si, si->plt_rel, si->plt_rel_count);
+    addRelocationsToSlotIndex(li, si, si->rel, si->rel_count);
+#endif
+    if (li->slotIndex.size() == 0) {
+        // no relocation info available; index every word of the sections instead
+        log.trace("No relocations found in %s, indexing whole sections", li->path.c_str());
+        addSectionToSlotIndex(li, li->gotOff, li->gotSize);
+        addSectionToSlotIndex(li, li->gotPltOff, li->gotPltSize);
+        addSectionToSlotIndex(li, li->dataRelRoOff, li->dataRelRoSize);
+    }
+    log.trace("Indexed %i distinct pointers in %s", (int) li->slotIndex.size(), li->path.c_str());
+}
+
+void HookManager::ensureSlotIndex(LibraryInfo* li) {
+    if (li->slotIndexBuilt)
+        return;
+    buildSlotIndex(li);
+    li->slotIndexBuilt = true;
+}
+
+void HookManager::beginWriteBatch() {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    writeBatchDepth++;
+}
+
+void HookManager::endWriteBatch() {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    if (writeBatchDepth == 1 && pendingObserverUpdates.size() > 0) {
+        // still within the batch, so that the dispatcher hooks are written together with everything else
+        std::vector<HookSymbol*> symbols (pendingObserverUpdates.begin(), pendingObserverUpdates.end());
+        pendingObserverUpdates.clear();
+        for (HookSymbol* symbol : symbols)
+            updateObservers(symbol);
+    }
+    if (--writeBatchDepth == 0)
+        commitWrites();
+}
+
+void HookManager::writeSlot(LibraryInfo* library, void** slot, void* value) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    // the slot index is keyed by the slots' contents, so it has to be built before we change any of them; otherwise
+    // the overwritten slots wouldn't be found by the original pointer anymore
+    ensureSlotIndex(library);
+    pendingWrites.push_back({library, slot, value});
+    if (writeBatchDepth == 0)
+        commitWrites();
+}
+
+void HookManager::commitWrites() {
+    if (pendingWrites.size() == 0)
+        return;
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    // stable, so that the last of multiple writes to the same slot wins
+    std::stable_sort(pendingWrites.begin(), pendingWrites.end(), [](PendingWrite const& a, PendingWrite const& b) {
+        return a.slot < b.slot;
+    });
+    std::vector<PendingWrite> procMemWrites; // the writes to mappings which can't be made writable
+    std::vector<std::pair<void**, void*>> failedWrites; // slot => the value it still contains (null if unknown)
+    for (size_t i = 0; i < pendingWrites.size(); ) {
+        size_t addr = (size_t) pendingWrites[i].slot;
+        LibraryMemMap* map = pendingWrites[i].library->findMap(addr);
+        if (map == nullptr) {
+            log.error("Patch site %p is not mapped", pendingWrites[i].slot);
+            failedWrites.push_back({pendingWrites[i].slot, nullptr});
+            i++;
+            continue;
+        }
+        // coalesce the writes to adjacent pages of the same mapping into a single write window
+        size_t windowStart = addr & ~(pageSize - 1);
+        size_t windowEnd = windowStart + pageSize;
+        size_t j = i + 1;
+        for ( ; j < pendingWrites.size(); j++) {
+            size_t nextAddr = (size_t) pendingWrites[j].slot;
+            if (nextAddr >= map->end || (nextAddr & ~(pageSize - 1)) > windowEnd)
+                break;
+            windowEnd = (nextAddr & ~(pageSize - 1)) + pageSize;
+        }
+        if (map->w) {
+            for (size_t k = i; k < j; k++)
+                publishPointer(pendingWrites[k].slot, pendingWrites[k].value);
+        } else if (map->needsHackyPatchToWork) {
+            procMemWrites.insert(procMemWrites.end(), pendingWrites.begin() + i, pendingWrites.begin() + j);
+        } else {
+            int prot = (map->r ? PROT_READ : 0) | (map->x ? PROT_EXEC : 0);
+            if (mprotect((void*) windowStart, windowEnd - windowStart, prot | PROT_WRITE) != 0) {
+                log.warn("mprotect() of %lx-%lx failed; patching the mapping through /proc/self/mem",
+                         (unsigned long) windowStart, (unsigned long) windowEnd);
+                map->needsHackyPatchToWork = true;
+                pendingWrites[i].library->mightNeedHackyPatch = true;
+                procMemWrites.insert(procMemWrites.end(), pendingWrites.begin() + i, pendingWrites.begin() + j);
+            } else {
+                for (size_t k = i; k < j; k++)
+                    publishPointer(pendingWrites[k].slot, pendingWrites[k].value);
+                mprotect((void*) windowStart, windowEnd - windowStart, prot);
+                unprotectedPageCount += (windowEnd - windowStart) / pageSize;
+            }
+        }
+        i = j;
+    }
+    pendingWrites.clear();
+    if (procMemWrites.size() > 0)
+        writeThroughProcMem(procMemWrites, failedWrites);
+    if (failedWrites.size() > 0)
+        forgetFailedWrites(failedWrites);
+}
+
+void HookManager::forgetFailedWrites(std::vector<std::pair<void**, void*>>& failedWrites) {
+    // the symbols have already recorded the new values as written; put back what the slots really contain, so that
+    // the next useSymbol() call writes them again instead of skipping them as up to date
+    std::sort(failedWrites.begin(), failedWrites.end());
+    for (HookSymbol* symbol : getAllSymbols()) {
+        for (size_t i = 0; i < symbol->siteSlots.size(); i++) {
+            auto it = std::lower_bound(failedWrites.begin(), failedWrites.end(),
+                                       std::pair<void**, void*>(symbol->siteSlots[i], nullptr));
+            if (it != failedWrites.end() && it->first == symbol->siteSlots[i])
+                symbol->siteValues[i] = it->second;
+        }
+    }
+}
+
+bool HookManager::openProcMem() {
+    // writes to /proc/self/mem ignore the page protection, just like a debugger's writes would
+    if (procMemFd < 0)
+        procMemFd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+    return procMemFd >= 0;
+}
+
+void HookManager::writeThroughProcMem(std::vector<PendingWrite> const& writes,
+                                      std::vector<std::pair<void**, void*>>& failedWrites) {
+    if (!openProcMem()) {
+        log.error("Failed to open /proc/self/mem; can't patch %i sites", (int) writes.size());
+        for (PendingWrite const& w : writes)
+            failedWrites.push_back({w.slot, nullptr});
+        return;
+    }
+    // the writes are sorted by address, so each run of adjacent slots can be written using a single call
+    std::vector<void*> values;
+    size_t failedCount = 0, callCount = 0;
+    for (size_t i = 0; i < writes.size(); ) {
+        size_t j = i + 1;
+        while (j < writes.size() && writes[j].slot == writes[j - 1].slot + 1)
+            j++;
+        values.clear();
+        for (size_t k = i; k < j; k++)
+            values.push_back(writes[k].value);
+        ssize_t size = (ssize_t) (values.size() * sizeof(void*));
+        if (pwrite64(procMemFd, values.data(), (size_t) size, (off64_t) (size_t) writes[i].slot) != size) {
+            failedCount += j - i;
+            // the write might have been partial, so read back what actually is in the slots
+            if (pread64(procMemFd, values.data(), (size_t) size, (off64_t) (size_t) writes[i].slot) != size)
+                std::fill(values.begin(), values.end(), nullptr);
+            for (size_t k = i; k < j; k++)
+                failedWrites.push_back({writes[k].slot, values[k - i]});
+        }
+        callCount++;
+        i = j;
+    }
+    if (failedCount > 0)
+        log.error("Failed to patch %i sites through /proc/self/mem; they'll be retried on the next change of their "
+                  "symbols", (int) failedCount);
+    log.trace("Patched %i sites through /proc/self/mem using %i writes", (int) (writes.size() - failedCount),
+              (int) callCount);
+}
+
+void HookManager::writeCode(LibraryInfo* li, void* addr, const void* data, size_t size) {
+    LibraryMemMap* map = li->findMap((size_t) addr);
+    if (map == nullptr || (size_t) addr + size > map->end)
+        throw std::runtime_error("The patched code isn't mapped");
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t windowStart = (size_t) addr & ~(pageSize - 1);
+    size_t windowEnd = ((size_t) addr + size + pageSize - 1) & ~(pageSize - 1);
+    // the window stays executable while being written, as the other code on its pages might be running
+    int prot = (map->r ? PROT_READ : 0) | (map->x ? PROT_EXEC : 0);
+    if (map->w) {
+        memcpy(addr, data, size);
+    } else if (!map->needsHackyPatchToWork &&
+               mprotect((void*) windowStart, windowEnd - windowStart, prot | PROT_WRITE) == 0) {
+        memcpy(addr, data, size);
+        mprotect((void*) windowStart, windowEnd - windowStart, prot);
+        unprotectedPageCount += (windowEnd - windowStart) / pageSize;
+    } else {
+        if (!map->needsHackyPatchToWork) {
+            log.warn("mprotect() of %lx-%lx failed; patching the mapping through /proc/self/mem",
+                     (unsigned long) windowStart, (unsigned long) windowEnd);
+            map->needsHackyPatchToWork = true;
+            li->mightNeedHackyPatch = true;
+        }
+        if (!openProcMem() || pwrite64(procMemFd, data, size, (off64_t) (size_t) addr) != (ssize_t) size)
+            throw std::runtime_error("Failed to write the patched code");
+    }
+    CodePool::flushCache(addr, size);
+}
+
+size_t HookManager::getLibrariesPrivateDirtyBytes() {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    std::vector<char> buffer;
+    size_t size;
+    readProcFile("/proc/self/smaps", buffer, size);
+    size_t ret = 0;
+    bool countMapping = false;
+    std::string name;
+    for (const char* p = buffer.data(); p < buffer.data() + size; ) {
+        const char* lineEnd = (const char*) memchr(p, '\n', buffer.data() + size - p);
+        if (lineEnd == nullptr)
+            lineEnd = buffer.data() + size;
+        if (lineEnd - p > 14 && memcmp(p, "Private_Dirty:", 14) == 0) {
+            if (countMapping)
+                ret += strtoul(p + 14, nullptr, 10) * 1024;
+        } else if ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f')) {
+            // a mapping header line; the path starts with the first slash
+            const char* namePtr = (const char*) memchr(p, '/', lineEnd - p);
+            name.assign(namePtr != nullptr ? namePtr : lineEnd, lineEnd);
+            while (name.length() > 0 && name[name.length() - 1] == ' ')
+                name.erase(name.length() - 1);
+            countMapping = (librariesByPath.count(name) > 0);
         }
-        addr += sizeof(void*);
+        p = lineEnd + 1;
     }
+    return ret;
 }
 
 void HookManager::HookSymbol::useSymbol(HookManager* mgr, void* newSym) {
-    for (auto& up : usage) {
-        if (mgr->libraries.count(up.first) <= 0)
+    usedSymbol = newSym;
+    mgr->beginWriteBatch();
+    size_t siteCount = siteSlots.size();
+    for (size_t i = 0; i < siteCount; i++) {
+        if (siteValues[i] == newSym || !mgr->liveLibraries[siteLibraries[i]])
+            continue;
+        HookSymbol* claim = (mgr->slotClaims.empty() ? nullptr : mgr->getSlotClaimAbove(this, siteSlots[i]));
+        if (claim != nullptr) {
+            // a vtable or import hook sits above us on this slot: it has to call our target instead of us writing
+            // the slot
+            siteValues[i] = newSym;
+            if (claim->originalSym != newSym) {
+                claim->originalSym = newSym;
+                mgr->refreshChain(claim);
+            }
             continue;
-        for (void* u : up.second)
-            *((void**) u) = newSym;
+        }
+        mgr->writeSlot(mgr->librariesByIndex[siteLibraries[i]], siteSlots[i], newSym);
+        siteValues[i] = newSym;
     }
+    mgr->endWriteBatch();
     for (void** u : customRefs)
-        *u = newSym;
+        publishPointer(u, newSym);
 }
 
-tml::HookManager::HookSymbol* HookManager::getSymbol(void* lib, std::string const& str, bool initialize) {
-    SymbolLibNameDesc p = {lib, str};
+void* HookManager::resolveSymbol(void* lib, SymbolId name) {
+    SymbolLibNameDesc p = {lib, name};
+    auto it = resolvedSymbols.find(p);
+    if (it != resolvedSymbols.end()) {
+        resolveCacheHits++;
+        return it->second;
+    }
+    resolveCacheMisses++;
+    HookSiteCacheEntry* cacheEntry = findHookSiteCacheEntry(lib, name);
+    if (cacheEntry != nullptr) {
+        void* sym = (void*) (((soinfo*) lib)->base + cacheEntry->symbolOffset);
+        resolvedSymbols[p] = sym;
+        return sym;
+    }
+    std::string const& str = symbolNames.getName(name);
+    void* sym = dlsym(lib, str.c_str());
+    if (sym == nullptr)
+        sym = dlsym_weak(lib, str.c_str());
+    if (sym == nullptr)
+        throw std::runtime_error("Failed to find symbol " + str);
+    resolvedSymbols[p] = sym;
+    return sym;
+}
 
-    HookSymbol* hookSymbol;
-    if (symbols.count(p) > 0) {
-        hookSymbol = symbols.at(p);
-        if (hookSymbol->initialized || !initialize)
-            return hookSymbol;
-    } else {
-        void* sym = dlsym(lib, str.c_str());
-        if (sym == nullptr)
-            sym = dlsym_weak(lib, str.c_str());
-        if (sym == nullptr)
-            throw std::runtime_error("Failed to find symbol " + str);
-        hookSymbol = new HookSymbol();
-        hookSymbol->libNameDesc = p;
-        hookSymbol->usedSymbol = hookSymbol->originalSym = sym;
-        if (!initialize)
-            return hookSymbol;
+tml::HookManager::HookSymbol* HookManager::getInlineSymbol(void* function, SymbolId name, bool libraryIsNew) {
+    auto it = inlineSymbols.find(function);
+    if (it != inlineSymbols.end())
+        return it->second;
+    auto patchIt = inlineHooks.find(function);
+    if (patchIt == inlineHooks.end()) {
+        // a library that has just been loaded isn't running on any other thread yet
+        if (inlinePatchingLocked && !libraryIsNew)
+            throw std::runtime_error("The entry of " + symbolNames.getName(name) + " can't be patched anymore, as "
+                                     "the game might be running it");
+        LibraryInfo* li = nullptr;
+        for (auto const& p : libraries) {
+            if (p.second->findMap((size_t) function) != nullptr)
+                li = p.second;
+        }
+        if (li == nullptr)
+            throw std::runtime_error("The function " + symbolNames.getName(name) + " isn't in a known library");
+        InlineHook* patch = InlineHook::create(function);
+        try {
+            writeCode(li, patch->entry, patch->entryCode, patch->entrySize);
+        } catch (...) {
+            delete patch->entrySlot;
+            delete patch;
+            throw;
+        }
+        log.trace("Patched the entry of %s at %p", symbolNames.getName(name).c_str(), function);
+        patchIt = inlineHooks.insert({function, patch}).first;
+    }
+    // the chain bottom calls the trampoline, and the entry slot acts as the only reference to update
+    HookSymbol* hookSymbol = new HookSymbol();
+    hookSymbol->libNameDesc = {function, name};
+    hookSymbol->initialized = true;
+    hookSymbol->inlineHook = patchIt->second;
+    hookSymbol->usedSymbol = hookSymbol->originalSym = patchIt->second->trampoline;
+    hookSymbol->customRefs.insert(patchIt->second->entrySlot);
+    inlineSymbols[function] = hookSymbol;
+    return hookSymbol;
+}
+
+void HookManager::ensureVtableIndex(LibraryInfo* li) {
+    if (li->vtableIndexBuilt)
+        return;
+    dlsym_foreach(li->ptr, [](void* userData, const char* name, void* addr, size_t size) {
+        if (strncmp(name, "_ZTV", 4) == 0 && size >= 3 * sizeof(void*))
+            ((LibraryInfo*) userData)->vtables.push_back({(void**) addr, size / sizeof(void*)});
+    }, li);
+    std::sort(li->vtables.begin(), li->vtables.end());
+    li->vtableIndexBuilt = true;
+}
+
+tml::HookManager::HookSymbol* HookManager::getSlotClaimAbove(HookSymbol* symbol, void** slot) {
+    auto it = slotClaims.find(slot);
+    if (it == slotClaims.end())
+        return nullptr;
+    std::vector<HookSymbol*> const& claims = it->second;
+    auto pos = std::find(claims.begin(), claims.end(), symbol);
+    if (pos == claims.end()) // a regular symbol, which is below all of the claiming symbols
+        return claims[0];
+    return (pos + 1 != claims.end() ? *(pos + 1) : nullptr);
+}
+
+/**
+ * Returns the mangled name of the type described by a typeinfo object, without the '*' prefix of the local types.
+ */
+static const char* getTypeInfoName(void** typeInfo) {
+    const char* name = (const char*) typeInfo[1];
+    return (*name == '*' ? name + 1 : name);
+}
+
+/**
+ * Compares the types by name as well, as a library loaded with RTLD_LOCAL has its own copy of the typeinfo objects.
+ */
+static bool isSameType(void** a, void** b) {
+    return a == b || strcmp(getTypeInfoName(a), getTypeInfoName(b)) == 0;
+}
+
+/**
+ * Checks if the class described by the typeinfo derives from the base class through primary bases only (the
+ * non-virtual bases at offset 0), ie. if its primary vtable starts with the base class's one. The kind of the typeinfo
+ * is told by the name of its own class rather than by its vtable, as every library may have its own copy of the C++
+ * runtime.
+ */
+static bool hasPrimaryBase(void** typeInfo, void** base, int depth = 0) {
+    if (depth > 32)
+        return false;
+    void** typeInfoClass = (void**) (*(void***) typeInfo)[-1];
+    const char* kind = getTypeInfoName(typeInfoClass);
+    if (strcmp(kind, "N10__cxxabiv120__si_class_type_infoE") == 0) {
+        void** parent = (void**) typeInfo[2];
+        return isSameType(parent, base) || hasPrimaryBase(parent, base, depth + 1);
     }
+    if (strcmp(kind, "N10__cxxabiv121__vmi_class_type_infoE") == 0) {
+        // unsigned int flags, baseCount; followed by { const type_info* base; long offsetFlags; } for each base
+        struct BaseInfo {
+            void** typeInfo;
+            long offsetFlags;
+        };
+        unsigned int baseCount = ((unsigned int*) (typeInfo + 2))[1];
+        BaseInfo* bases = (BaseInfo*) ((unsigned int*) (typeInfo + 2) + 2);
+        for (unsigned int i = 0; i < baseCount; i++) {
+            // the lowest bit marks virtual bases, and the offset is stored above the low 8 bits
+            if ((bases[i].offsetFlags & 1) != 0 || (bases[i].offsetFlags >> 8) != 0)
+                continue;
+            if (isSameType(bases[i].typeInfo, base) || hasPrimaryBase(bases[i].typeInfo, base, depth + 1))
+                return true;
+        }
+    }
+    return false;
+}
 
-    for (auto& lp : libraries) {
-        soinfo* si = (soinfo*) lp.second->ptr;
-        findSymbolAndAddTo(hookSymbol->usage[lp.second->ptr], si->base, si->size, lp.second->gotOff,
-                           lp.second->gotSize, hookSymbol->originalSym);
-        findSymbolAndAddTo(hookSymbol->usage[lp.second->ptr], si->base, si->size, lp.second->gotPltOff,
-                           lp.second->gotPltSize, hookSymbol->originalSym);
-        findSymbolAndAddTo(hookSymbol->usage[lp.second->ptr], si->base, si->size, lp.second->dataRelRoOff,
-                           lp.second->dataRelRoSize, hookSymbol->originalSym);
+tml::HookManager::HookSymbol* HookManager::getVtableSymbol(void* lib, SymbolId vtableName, unsigned int index,
+                                                           bool allInheriting) {
+    auto libIt = libraries.find(lib);
+    if (libIt == libraries.end())
+        throw std::runtime_error("Unknown library");
+    LibraryInfo* li = libIt->second;
+    void** vtable = (void**) resolveSymbol(lib, vtableName);
+    ensureVtableIndex(li);
+    auto vtIt = std::lower_bound(li->vtables.begin(), li->vtables.end(), std::pair<void**, size_t>(vtable, 0));
+    if (vtIt == li->vtables.end() || vtIt->first != vtable)
+        throw std::runtime_error(symbolNames.getName(vtableName) + " is not a vtable");
+    // the function pointers are preceded by the offset to the top of the object and the typeinfo pointer
+    if (2 + (size_t) index >= vtIt->second)
+        throw std::runtime_error("The vtable index is out of bounds");
+    void** slot = vtable + 2 + index;
+    auto it = vtableSymbols.find(slot);
+    if (it != vtableSymbols.end())
+        return it->second;
+
+    std::vector<std::pair<void**, LibraryInfo*>> slots;
+    slots.push_back({slot, li});
+    void** typeInfo = (void**) vtable[1];
+    if (allInheriting && typeInfo == nullptr) {
+        log.warn("%s has no typeinfo; only patching the vtable itself", symbolNames.getName(vtableName).c_str());
+    } else if (allInheriting) {
+        void* function = *slot;
+        for (LibraryInfo* l : librariesByIndex) {
+            if (l == nullptr || !liveLibraries[l->index])
+                continue;
+            ensureVtableIndex(l);
+            for (auto const& vt : l->vtables) {
+                // only look at the primary vtables (the ones with no offset to the top of the object) of the derived
+                // classes; the base and the sibling classes (or identical code folding) may share the pointer as well
+                if (vt.first != vtable && 2 + (size_t) index < vt.second && vt.first[0] == nullptr &&
+                        vt.first[2 + index] == function && vt.first[1] != nullptr &&
+                        hasPrimaryBase((void**) vt.first[1], typeInfo))
+                    slots.push_back({vt.first + 2 + index, l});
+            }
+        }
     }
+
+    char name[32];
+    snprintf(name, sizeof(name), "[%u]", index);
+    HookSymbol* hookSymbol = new HookSymbol();
+    hookSymbol->libNameDesc = {slot, internSymbol((symbolNames.getName(vtableName) + name).c_str())};
     hookSymbol->initialized = true;
+    // if the function is hooked already, the chain bottom calls that hook
+    hookSymbol->usedSymbol = hookSymbol->originalSym = *slot;
+    for (auto const& s : slots)
+        claimSlot(hookSymbol, s.second, s.first);
+    vtableSymbols[slot] = hookSymbol;
+    log.trace("Hooking %s (%i vtables)", symbolNames.getName(hookSymbol->libNameDesc.name).c_str(),
+              (int) slots.size());
+    return hookSymbol;
+}
+
+tml::HookManager::HookSymbol* HookManager::getImportSymbol(void* importer, SymbolId name) {
+    SymbolLibNameDesc p = {importer, name};
+    auto it = importSymbols.find(p);
+    if (it != importSymbols.end())
+        return it->second;
+    auto libIt = libraries.find(importer);
+    if (libIt == libraries.end())
+        throw std::runtime_error("Unknown library");
+    LibraryInfo* li = libIt->second;
+    std::string const& str = symbolNames.getName(name);
+    void* sym = dlsym(RTLD_DEFAULT, str.c_str());
+    if (sym == nullptr)
+        throw std::runtime_error("Failed to find symbol " + str);
+    ensureSlotIndex(li);
+    auto slotIt = li->slotIndex.find(sym);
+    if (slotIt == li->slotIndex.end())
+        throw std::runtime_error("The library doesn't import " + str);
+
+    HookSymbol* hookSymbol = new HookSymbol();
+    hookSymbol->libNameDesc = p;
+    hookSymbol->initialized = true;
+    // if the function is hooked already, the chain bottom calls that hook
+    hookSymbol->usedSymbol = hookSymbol->originalSym = *slotIt->second[0];
+    for (void** slot : slotIt->second)
+        claimSlot(hookSymbol, li, slot);
+    importSymbols[p] = hookSymbol;
+    return hookSymbol;
+}
+
+void HookManager::claimSlot(HookSymbol* symbol, LibraryInfo* li, void** slot) {
+    symbol->siteSlots.push_back(slot);
+    symbol->siteLibraries.push_back(li->index);
+    symbol->siteValues.push_back(*slot);
+    slotClaims[slot].push_back(symbol);
+}
+
+std::vector<tml::HookManager::HookSymbol*> HookManager::getAllSymbols() const {
+    std::vector<HookSymbol*> ret;
+    ret.reserve(symbols.size() + inlineSymbols.size() + vtableSymbols.size() + importSymbols.size());
+    for (auto& p : symbols)
+        ret.push_back(p.second);
+    for (auto& p : inlineSymbols)
+        ret.push_back(p.second);
+    for (auto& p : vtableSymbols)
+        ret.push_back(p.second);
+    for (auto& p : importSymbols)
+        ret.push_back(p.second);
+    return ret;
+}
+
+tml::HookManager::HookSymbol* HookManager::findOrCreateSymbol(void* lib, SymbolId name) {
+    SymbolLibNameDesc p = {lib, name};
+    auto it = symbols.find(p);
+    if (it != symbols.end())
+        return it->second;
+
+    void* sym = resolveSymbol(lib, name);
+    HookSymbol* hookSymbol = new HookSymbol();
+    hookSymbol->libNameDesc = p;
+    hookSymbol->usedSymbol = hookSymbol->originalSym = sym;
     symbols[p] = hookSymbol;
     return hookSymbol;
 }
 
+void HookManager::initializeSymbols(std::vector<HookSymbol*> const& pending) {
+    std::unordered_map<void*, HookSymbol*> targets; // original symbol => HookSymbol
+    for (HookSymbol* symbol : pending) {
+        if (symbol != nullptr && !symbol->initialized)
+            targets.insert({symbol->originalSym, symbol});
+    }
+    if (targets.size() == 0)
+        return;
+    // the cached patch sites of each of the symbols, by library path
+    std::unordered_map<HookSymbol*, std::unordered_map<std::string, HookSiteCacheLibrary const*>> cachedSites;
+    for (auto& t : targets) {
+        HookSiteCacheEntry* entry = findHookSiteCacheEntry(t.second->libNameDesc.lib, t.second->libNameDesc.name);
+        if (entry == nullptr)
+            continue;
+        auto& libs = cachedSites[t.second];
+        for (HookSiteCacheLibrary const& lib : entry->libraries)
+            libs[lib.path] = &lib;
+    }
+    std::unordered_set<HookSymbol*> scannedSymbols;
+    size_t cachedCount = 0;
+    for (auto& lp : libraries) {
+        LibraryInfo* li = lp.second;
+        for (auto& t : targets) {
+            HookSymbol* symbol = t.second;
+            auto cacheIt = cachedSites.find(symbol);
+            if (cacheIt != cachedSites.end()) {
+                auto libIt = cacheIt->second.find(li->path);
+                if (libIt != cacheIt->second.end() && addCachedSites(li, symbol, *libIt->second)) {
+                    cachedCount++;
+                    continue;
+                }
+            }
+            scannedSymbols.insert(symbol);
+            ensureSlotIndex(li);
+            auto it = li->slotIndex.find(t.first);
+            if (it == li->slotIndex.end() || li->slotOwners.count(t.first) > 0)
+                continue;
+            li->slotOwners[t.first] = symbol;
+            for (void** slot : it->second) {
+                symbol->siteSlots.push_back(slot);
+                symbol->siteLibraries.push_back(li->index);
+                symbol->siteValues.push_back(t.first);
+            }
+        }
+    }
+    log.trace("Used %i cached patch site lists for %i library lookups", (int) cachedCount,
+              (int) (libraries.size() * targets.size()));
+    for (HookSymbol* symbol : scannedSymbols)
+        updateHookSiteCacheEntry(symbol);
+    for (HookSymbol* symbol : pending) {
+        if (symbol != nullptr)
+            symbol->initialized = true;
+    }
+}
+
+void HookManager::applySymbolsToLibraries(std::vector<LibraryInfo*> const& newLibraries) {
+    if (newLibraries.size() == 0)
+        return;
+    beginWriteBatch();
+    for (auto& p : symbols) {
+        HookSymbol* symbol = p.second;
+        if (!symbol->initialized)
+            continue;
+        void* sym = symbol->originalSym;
+        for (LibraryInfo* li : newLibraries) {
+            ensureSlotIndex(li);
+            auto it = li->slotIndex.find(sym);
+            if (it == li->slotIndex.end() || li->slotOwners.count(sym) > 0)
+                continue;
+            li->slotOwners[sym] = symbol;
+            for (void** slot : it->second) {
+                symbol->siteSlots.push_back(slot);
+                symbol->siteLibraries.push_back(li->index);
+                symbol->siteValues.push_back(sym);
+            }
+        }
+        symbol->useSymbol(this, symbol->usedSymbol);
+    }
+    if (detachedSymbols.size() > 0)
+        reattachHooks(newLibraries);
+    endWriteBatch();
+}
+
+tml::HookManager::HookSiteCacheEntry* HookManager::findHookSiteCacheEntry(void* lib, SymbolId name) {
+    auto libIt = libraries.find(lib);
+    if (libIt == libraries.end())
+        return nullptr;
+    LibraryInfo* li = libIt->second;
+    auto it = hookSiteCache.find({li->path, name});
+    if (it == hookSiteCache.end() || it->second.fileSize != li->fileSize ||
+            it->second.fileTimestamp != li->fileTimestamp)
+        return nullptr;
+    return &it->second;
+}
+
+bool HookManager::addCachedSites(LibraryInfo* li, HookSymbol* symbol, HookSiteCacheLibrary const& cached) {
+    if (cached.fileSize != li->fileSize || cached.fileTimestamp != li->fileTimestamp)
+        return false;
+    void* sym = symbol->originalSym;
+    auto ownerIt = li->slotOwners.find(sym);
+    if (ownerIt != li->slotOwners.end())
+        return true; // already claimed by another symbol; nothing to add
+    // every cached slot must still point to the symbol, otherwise fall back to scanning the library
+    soinfo* si = (soinfo*) li->ptr;
+    for (Elf32_Off off : cached.slotOffsets) {
+        if (!li->isPatchableOffset(off) || *((void**) (si->base + off)) != sym)
+            return false;
+    }
+    if (cached.slotOffsets.size() > 0)
+        li->slotOwners[sym] = symbol;
+    for (Elf32_Off off : cached.slotOffsets) {
+        symbol->siteSlots.push_back((void**) (si->base + off));
+        symbol->siteLibraries.push_back(li->index);
+        symbol->siteValues.push_back(sym);
+    }
+    return true;
+}
+
+void HookManager::updateHookSiteCacheEntry(HookSymbol* symbol) {
+    auto libIt = libraries.find(symbol->libNameDesc.lib);
+    if (libIt == libraries.end())
+        return;
+    LibraryInfo* li = libIt->second;
+    soinfo* si = (soinfo*) li->ptr;
+    size_t addr = (size_t) symbol->originalSym;
+    if (addr < si->base || addr >= si->base + si->size)
+        return; // the symbol isn't defined in the library itself (eg. a libc function); can't store it as an offset
+    HookSiteCacheEntry entry;
+    entry.fileSize = li->fileSize;
+    entry.fileTimestamp = li->fileTimestamp;
+    entry.symbolOffset = (Elf32_Off) (addr - si->base);
+    std::unordered_map<unsigned int, size_t> entryLibraries; // LibraryInfo::index => index in entry.libraries
+    for (auto& lp : libraries) {
+        entryLibraries[lp.second->index] = entry.libraries.size();
+        entry.libraries.push_back({lp.second->path, lp.second->fileSize, lp.second->fileTimestamp, {}});
+    }
+    for (size_t i = 0; i < symbol->siteSlots.size(); i++) {
+        auto it = entryLibraries.find(symbol->siteLibraries[i]);
+        if (it == entryLibraries.end())
+            continue;
+        soinfo* siteSi = (soinfo*) librariesByIndex[symbol->siteLibraries[i]]->ptr;
+        entry.libraries[it->second].slotOffsets.push_back((Elf32_Off) ((size_t) symbol->siteSlots[i] - siteSi->base));
+    }
+    hookSiteCache[{li->path, symbol->libNameDesc.name}] = std::move(entry);
+    hookSiteCacheDirty = true;
+}
+
+SymbolId HookManager::internSymbol(const char* name, size_t length) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    return symbolNames.intern(name, length);
+}
+
+tml::HookManager::HookSymbol* HookManager::getSymbol(void* lib, SymbolId name, bool initialize) {
+    TraceScope trace ("getSymbol");
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookSymbol* hookSymbol = findOrCreateSymbol(lib, name);
+    if (initialize && !hookSymbol->initialized)
+        initializeSymbols({hookSymbol});
+    return hookSymbol;
+}
+
 void HookManager::destroySymbol(HookSymbol* symbol) {
     symbol->useSymbol(this, symbol->originalSym);
-    for (auto& up : symbol->usage) {
-        if (libraries.count(up.first) <= 0)
+    auto vtableIt = vtableSymbols.find((void**) symbol->libNameDesc.lib);
+    auto importIt = importSymbols.find(symbol->libNameDesc);
+    bool isVtableSymbol = (vtableIt != vtableSymbols.end() && vtableIt->second == symbol);
+    bool isImportSymbol = (importIt != importSymbols.end() && importIt->second == symbol);
+    if (isVtableSymbol || isImportSymbol) {
+        for (void** slot : symbol->siteSlots) {
+            auto claimIt = slotClaims.find(slot);
+            if (claimIt == slotClaims.end())
+                continue;
+            std::vector<HookSymbol*>& claims = claimIt->second;
+            claims.erase(std::remove(claims.begin(), claims.end(), symbol), claims.end());
+            if (claims.size() == 0)
+                slotClaims.erase(claimIt);
+        }
+        if (isVtableSymbol)
+            vtableSymbols.erase(vtableIt);
+        else
+            importSymbols.erase(importIt);
+        delete symbol;
+        return;
+    }
+    // release the slots so that another symbol with the same address can claim them
+    for (size_t i = 0; i < librariesByIndex.size(); i++) {
+        if (!liveLibraries[i])
             continue;
-        for (auto& u : up.second)
-            hookedSymbolRefs.erase(u);
+        auto it = librariesByIndex[i]->slotOwners.find(symbol->originalSym);
+        if (it != librariesByIndex[i]->slotOwners.end() && it->second == symbol)
+            librariesByIndex[i]->slotOwners.erase(it);
     }
     for (auto& u : symbol->customRefs)
         customRefToSymbol.erase(u);
-    symbols.erase({symbol->libNameDesc.lib, symbol->libNameDesc.name});
+    if (symbol->inlineHook != nullptr)
+        inlineSymbols.erase(symbol->libNameDesc.lib);
+    else
+        symbols.erase(symbol->libNameDesc);
     delete symbol;
 }
 
-tml::HookManager::HookInfo* HookManager::hook(void* lib, std::string const& sym, void* override, void** org) {
-    HookInfo* hookInfo = new HookInfo();
-    hookInfo->symbol = getSymbol(lib, sym);
+void* HookManager::HookInfo::getTarget() const {
+    if (placeholder)
+        return (parent != nullptr ? parent->getTarget() : symbol->originalSym);
+    return (instrumentation != nullptr ? instrumentation->thunk : overrideSym);
+}
+
+tml::HookManager::HookInfo* HookManager::addHook(HookSymbol* symbol, void* override, void** org, Mod* owner) {
+    HookInfo* hookInfo = nullptr;
+    if (owner != nullptr) {
+        // take the place of the lowest placeholder the mod has left in this chain
+        for (HookInfo* h = symbol->hook; h != nullptr; h = h->parent) {
+            if (h->placeholder && h->owner == owner)
+                hookInfo = h;
+        }
+    }
+    if (hookInfo == nullptr) {
+        hookInfo = new HookInfo();
+        hookInfo->symbol = symbol;
+        hookInfo->owner = owner;
+        hookInfo->parent = symbol->hook;
+        if (hookInfo->parent != nullptr)
+            hookInfo->parent->child = hookInfo;
+        symbol->hook = hookInfo;
+    }
     hookInfo->overrideSym = override;
     hookInfo->userOrgSym = org;
-    hookInfo->parent = hookInfo->symbol->hook;
-    if (hookInfo->parent != nullptr)
-        hookInfo->parent->child = hookInfo;
+    hookInfo->instrumentation = nullptr;
+    // our own hooks aren't instrumented: the thunk would hide the caller's return address from them
+    if (instrumentationEnabled && owner != nullptr) {
+        hookInfo->instrumentation = HookInstrumentation::create(override);
+        if (hookInfo->instrumentation == nullptr)
+            log.warn("Failed to instrument the hook of %s", symbolNames.getName(symbol->libNameDesc.name).c_str());
+    }
+    // the original function pointer has to be valid before any of the call sites can reach the new hook
     if (hookInfo->userOrgSym != nullptr)
-        *hookInfo->userOrgSym = (hookInfo->parent != nullptr ? hookInfo->parent->overrideSym :
-                                 hookInfo->symbol->usedSymbol);
-    hookInfo->symbol->useSymbol(this, override);
-    hookInfo->symbol->hook = hookInfo;
+        publishPointer(hookInfo->userOrgSym, (hookInfo->parent != nullptr ? hookInfo->parent->getTarget() :
+                                              symbol->originalSym));
+    hookInfo->placeholder = false;
+    return hookInfo;
+}
+
+void HookManager::refreshChain(HookSymbol* symbol) {
+    HookInfo* bottom = symbol->hook;
+    while (bottom != nullptr && bottom->parent != nullptr)
+        bottom = bottom->parent;
+    // go from the bottom up, so every function is valid before a hook above it (or a call site) can call it
+    for (HookInfo* h = bottom; h != nullptr; h = h->child) {
+        if (!h->placeholder && h->userOrgSym != nullptr)
+            publishPointer(h->userOrgSym, (h->parent != nullptr ? h->parent->getTarget() : symbol->originalSym));
+    }
+    symbol->useSymbol(this, (symbol->hook != nullptr ? symbol->hook->getTarget() : symbol->originalSym));
+}
+
+tml::HookManager::HookInfo* HookManager::hook(void* lib, SymbolId sym, void* override, void** org, Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookInfo* hookInfo = addHook(getSymbol(lib, sym), override, org, owner);
+    refreshChain(hookInfo->symbol);
+    return hookInfo;
+}
+
+tml::HookManager::HookInfo* HookManager::hookInline(void* function, SymbolId name, void* override, void** org,
+                                                    Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookInfo* hookInfo = addHook(getInlineSymbol(function, name), override, org, owner);
+    refreshChain(hookInfo->symbol);
     return hookInfo;
 }
 
+tml::HookManager::HookInfo* HookManager::hookVirtual(void* lib, SymbolId vtableName, unsigned int index,
+                                                     void* override, void** org, bool allInheriting, Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookInfo* hookInfo = addHook(getVtableSymbol(lib, vtableName, index, allInheriting), override, org, owner);
+    refreshChain(hookInfo->symbol);
+    return hookInfo;
+}
+
+tml::HookManager::HookInfo* HookManager::hookImports(void* importer, SymbolId name, void* override, void** org,
+                                                     Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookInfo* hookInfo = addHook(getImportSymbol(importer, name), override, org, owner);
+    refreshChain(hookInfo->symbol);
+    return hookInfo;
+}
+
+void HookManager::addObserver(void* lib, SymbolId name, HookObserver const& observer) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookSymbol* symbol = getSymbol(lib, name);
+    observerSets[symbol].observers.push_back(observer);
+    // within a write batch the observer array is built only once, after all of the symbol's observers are added
+    if (writeBatchDepth > 0)
+        pendingObserverUpdates.insert(symbol);
+    else
+        updateObservers(symbol);
+}
+
+void HookManager::removeObservers(Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    std::vector<HookSymbol*> changedSymbols;
+    for (auto& p : observerSets) {
+        std::vector<HookObserver>& observers = p.second.observers;
+        size_t oldSize = observers.size();
+        observers.erase(std::remove_if(observers.begin(), observers.end(), [owner](HookObserver const& o) {
+            return o.owner == owner;
+        }), observers.end());
+        if (observers.size() != oldSize)
+            changedSymbols.push_back(p.first);
+    }
+    beginWriteBatch();
+    for (HookSymbol* symbol : changedSymbols)
+        updateObservers(symbol);
+    endWriteBatch();
+}
+
+void HookManager::updateObservers(HookSymbol* symbol) {
+    ObserverSet& set = observerSets[symbol];
+    if (set.observers.size() == 0) {
+        HookInfo* hook = set.hook;
+        observerSets.erase(symbol);
+        if (hook != nullptr)
+            unhook(hook);
+        return;
+    }
+    ObserverDispatcherInfo const& dispatcher = set.observers[0].dispatcher;
+    // the arrays are never freed, as a dispatcher might still be iterating the old one
+    size_t count = set.observers.size();
+    HookObserverArray* array = (HookObserverArray*) malloc(sizeof(HookObserverArray) + count * sizeof(void*));
+    array->pre = (void**) (array + 1);
+    array->preCount = 0;
+    for (HookObserver const& o : set.observers) {
+        if (!o.post)
+            array->pre[array->preCount++] = o.callback;
+    }
+    array->post = array->pre + array->preCount;
+    array->postCount = 0;
+    for (HookObserver const& o : set.observers) {
+        if (o.post)
+            array->post[array->postCount++] = o.callback;
+    }
+    publishPointer((void**) dispatcher.observers, array);
+
+    if (set.hook == nullptr) {
+        set.hook = addHook(symbol, dispatcher.dispatch, dispatcher.original, nullptr);
+        refreshChain(symbol);
+    } else if (set.hook->overrideSym != dispatcher.dispatch) {
+        // switch to another mod's dispatcher, keeping the position in the chain
+        set.hook->overrideSym = dispatcher.dispatch;
+        set.hook->userOrgSym = dispatcher.original;
+        set.hook->instrumentation = nullptr;
+        refreshChain(symbol);
+    }
+}
+
+void* HookManager::findSymbol(void* lib, SymbolId name) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    return resolveSymbol(lib, name);
+}
+
+void* HookManager::findPattern(void* lib, BytePattern const& pattern) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    auto lit = libraries.find(lib);
+    if (lit == libraries.end())
+        throw std::runtime_error("Unknown library");
+    LibraryInfo* li = lit->second;
+    size_t base = (size_t) ((soinfo*) li->ptr)->base;
+
+    auto cit = patternCache.find({li->path, pattern.getText()});
+    if (cit != patternCache.end() && cit->second.fileSize == li->fileSize &&
+            cit->second.fileTimestamp == li->fileTimestamp) {
+        if (cit->second.offset == PATTERN_NOT_FOUND)
+            return nullptr;
+        // make sure the cached match is still there before handing it out
+        size_t addr = base + cit->second.offset;
+        LibraryMemMap* map = li->findMap(addr);
+        if (map != nullptr && map->r && map->x && addr + pattern.size() <= map->end &&
+                pattern.matches((const unsigned char*) addr))
+            return (void*) addr;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    const unsigned char* match = nullptr;
+    size_t scannedSize = 0;
+    for (LibraryMemMap const& map : li->memMaps) {
+        if (!map.r || !map.x)
+            continue;
+        scannedSize += map.end - map.start;
+        match = pattern.find((const unsigned char*) map.start, (const unsigned char*) map.end);
+        if (match != nullptr)
+            break;
+    }
+    log.trace("Scanned %i KiB of %s for %s in %i ms", (int) (scannedSize / 1024), li->path.c_str(),
+              pattern.getText().c_str(), (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - startTime).count());
+    patternCache[{li->path, pattern.getText()}] = {li->fileSize, li->fileTimestamp,
+                                                   match != nullptr ? (Elf32_Off) ((size_t) match - base)
+                                                                    : PATTERN_NOT_FOUND};
+    patternCacheDirty = true;
+    return (void*) match;
+}
+
+std::vector<tml::HookManager::HookInfo*> HookManager::hookMany(std::vector<HookRequest> const& requests) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    std::vector<HookSymbol*> requestSymbols(requests.size(), nullptr);
+    for (size_t i = 0; i < requests.size(); i++) {
+        try {
+            requestSymbols[i] = findOrCreateSymbol(requests[i].lib, requests[i].sym);
+        } catch (std::exception& e) {
+            log.error("Failed to hook %s: %s", symbolNames.getName(requests[i].sym).c_str(), e.what());
+        }
+    }
+    initializeSymbols(requestSymbols);
+
+    beginWriteBatch();
+    std::vector<HookInfo*> ret;
+    std::unordered_set<HookSymbol*> changedSymbols;
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (requestSymbols[i] == nullptr) {
+            ret.push_back(nullptr);
+            continue;
+        }
+        ret.push_back(addHook(requestSymbols[i], requests[i].override, requests[i].org,
+                              requests[i].owner));
+        changedSymbols.insert(requestSymbols[i]);
+    }
+    for (HookSymbol* symbol : changedSymbols)
+        refreshChain(symbol);
+    endWriteBatch();
+    return ret;
+}
+
 void HookManager::unhook(HookInfo* hook) {
-    if (hook->child == nullptr) {
-        if (hook->parent == nullptr) {
-            if (hook->symbol->customRefs.size() == 0) {
-                destroySymbol(hook->symbol);
-            } else {
-                hook->symbol->useSymbol(this, hook->symbol->originalSym);
-            }
-        } else {
-            hook->symbol->useSymbol(this, hook->parent->symbol);
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    HookSymbol* symbol = hook->symbol;
+    if (symbol == nullptr) {
+        for (auto it = detachedSymbols.begin(); it != detachedSymbols.end(); it++) {
+            auto hookIt = std::find(it->hooks.begin(), it->hooks.end(), hook);
+            if (hookIt == it->hooks.end())
+                continue;
+            it->hooks.erase(hookIt);
+            if (it->hooks.size() == 0)
+                detachedSymbols.erase(it);
+            break;
         }
-    } else {
+        delete hook;
+        return;
+    }
+    if (hook->child != nullptr)
         hook->child->parent = hook->parent;
-        if (hook->parent != nullptr) {
-            hook->parent->child = hook->child;
-            *hook->child->userOrgSym = hook->parent->overrideSym;
-        } else {
-            *hook->child->userOrgSym = hook->symbol->originalSym;
+    else
+        symbol->hook = hook->parent;
+    if (hook->parent != nullptr)
+        hook->parent->child = hook->child;
+    delete hook;
+    if (symbol->hook == nullptr && symbol->customRefs.size() == 0)
+        destroySymbol(symbol);
+    else
+        refreshChain(symbol);
+}
+
+void HookManager::detachHooks(Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    beginWriteBatch();
+    for (HookSymbol* symbol : getAllSymbols()) {
+        bool changed = false;
+        for (HookInfo* h = symbol->hook; h != nullptr; h = h->parent) {
+            if (h->owner != owner || h->placeholder)
+                continue;
+            h->placeholder = true;
+            h->overrideSym = nullptr;
+            h->userOrgSym = nullptr;
+            h->instrumentation = nullptr;
+            changed = true;
         }
+        if (changed)
+            refreshChain(symbol);
+    }
+    endWriteBatch();
+}
+
+void HookManager::removePlaceholders(Mod* owner) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    std::vector<HookInfo*> placeholders;
+    for (HookSymbol* symbol : getAllSymbols()) {
+        for (HookInfo* h = symbol->hook; h != nullptr; h = h->parent) {
+            if (h->owner == owner && h->placeholder)
+                placeholders.push_back(h);
+        }
+    }
+    for (DetachedSymbol const& detached : detachedSymbols) {
+        for (HookInfo* h : detached.hooks) {
+            if (h->owner == owner && h->placeholder)
+                placeholders.push_back(h);
+        }
+    }
+    beginWriteBatch();
+    for (HookInfo* h : placeholders)
+        unhook(h);
+    endWriteBatch();
+}
+
+void HookManager::detachSymbolHooks(HookSymbol* symbol, LibraryInfo* li) {
+    DetachedSymbol detached;
+    detached.libraryPath = li->path;
+    detached.name = symbol->libNameDesc.name;
+    auto vtableIt = vtableSymbols.find((void**) symbol->libNameDesc.lib);
+    if (symbol->inlineHook != nullptr) {
+        detached.kind = DetachedSymbol::Kind::INLINE;
+    } else if (vtableIt != vtableSymbols.end() && vtableIt->second == symbol) {
+        // the name of a vtable symbol is the vtable name followed by the index in brackets
+        std::string const& name = symbolNames.getName(symbol->libNameDesc.name);
+        size_t bracket = name.rfind('[');
+        detached.kind = DetachedSymbol::Kind::VTABLE;
+        detached.name = internSymbol(name.c_str(), bracket);
+        detached.vtableIndex = (unsigned int) atoi(&name[bracket + 1]);
+        detached.allInheriting = (symbol->siteSlots.size() > 1);
+    } else if (importSymbols.count(symbol->libNameDesc) > 0 && importSymbols.at(symbol->libNameDesc) == symbol) {
+        detached.kind = DetachedSymbol::Kind::IMPORT;
+    } else {
+        detached.kind = DetachedSymbol::Kind::SYMBOL;
+    }
+    while (symbol->hook != nullptr) {
+        HookInfo* hook = symbol->hook;
+        symbol->hook = hook->parent;
+        if (hook->owner == nullptr) {
+            delete hook; // our own hooks (eg. observer dispatchers) are set up again by their users
+            continue;
+        }
+        if (!hook->placeholder)
+            log.warn("The hook of %s installed by %s is detached until its library is loaded again",
+                     symbolNames.getName(symbol->libNameDesc.name).c_str(), hook->owner->getMeta().getId().c_str());
+        hook->symbol = nullptr;
+        hook->parent = hook->child = nullptr;
+        detached.hooks.insert(detached.hooks.begin(), hook);
+    }
+    if (detached.hooks.size() > 0)
+        detachedSymbols.push_back(std::move(detached));
+}
+
+void HookManager::reattachHooks(std::vector<LibraryInfo*> const& newLibraries) {
+    for (auto it = detachedSymbols.begin(); it != detachedSymbols.end(); ) {
+        LibraryInfo* li = nullptr;
+        for (LibraryInfo* l : newLibraries) {
+            if (l->path == it->libraryPath)
+                li = l;
+        }
+        if (li == nullptr) {
+            it++;
+            continue;
+        }
+        HookSymbol* symbol;
+        try {
+            switch (it->kind) {
+                case DetachedSymbol::Kind::SYMBOL:
+                    symbol = getSymbol(li->ptr, it->name);
+                    break;
+                case DetachedSymbol::Kind::INLINE:
+                    symbol = getInlineSymbol(resolveSymbol(li->ptr, it->name), it->name, true);
+                    break;
+                case DetachedSymbol::Kind::VTABLE:
+                    symbol = getVtableSymbol(li->ptr, it->name, it->vtableIndex, it->allInheriting);
+                    break;
+                default:
+                    symbol = getImportSymbol(li->ptr, it->name);
+                    break;
+            }
+        } catch (std::exception& e) {
+            log.warn("Failed to reattach the hooks of %s: %s", symbolNames.getName(it->name).c_str(), e.what());
+            it++;
+            continue;
+        }
+        // the detached hooks go above the ones installed since then, in their original order
+        for (HookInfo* h : it->hooks) {
+            h->symbol = symbol;
+            h->parent = symbol->hook;
+            if (h->parent != nullptr)
+                h->parent->child = h;
+            symbol->hook = h;
+        }
+        refreshChain(symbol);
+        log.trace("Reattached %i hooks of %s", (int) it->hooks.size(), symbolNames.getName(it->name).c_str());
+        it = detachedSymbols.erase(it);
+    }
+}
+
+void HookManager::releaseLibrary(void* lib) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    auto it = libraries.find(lib);
+    if (it == libraries.end())
+        return;
+    LibraryInfo* li = it->second;
+    soinfo* si = (soinfo*) li->ptr;
+    beginWriteBatch();
+    std::vector<void**> refs;
+    for (auto& r : customRefToSymbol) {
+        if ((size_t) r.first >= si->base && (size_t) r.first < si->base + si->size)
+            refs.push_back(r.first);
+    }
+    for (void** ref : refs)
+        removeCustomRef(ref);
+    std::vector<HookSymbol*> libSymbols;
+    for (auto& p : symbols) {
+        if (p.first.lib == lib)
+            libSymbols.push_back(p.second);
+    }
+    for (auto& p : inlineSymbols) {
+        if ((size_t) p.first >= si->base && (size_t) p.first < si->base + si->size)
+            libSymbols.push_back(p.second);
+    }
+    for (auto& p : vtableSymbols) {
+        if ((size_t) p.first >= si->base && (size_t) p.first < si->base + si->size)
+            libSymbols.push_back(p.second);
+    }
+    for (auto& p : importSymbols) {
+        if (p.first.lib == lib)
+            libSymbols.push_back(p.second);
+    }
+    for (auto patchIt = inlineHooks.begin(); patchIt != inlineHooks.end(); ) {
+        if ((size_t) patchIt->first >= si->base && (size_t) patchIt->first < si->base + si->size)
+            patchIt = inlineHooks.erase(patchIt);
+        else
+            patchIt++;
+    }
+    for (HookSymbol* symbol : libSymbols) {
+        observerSets.erase(symbol);
+        pendingObserverUpdates.erase(symbol);
+        log.trace("Dropping the hooks and references of %s, as its library is being unloaded",
+                  symbolNames.getName(symbol->libNameDesc.name).c_str());
+        detachSymbolHooks(symbol, li);
+        destroySymbol(symbol);
+    }
+    // the library might have contained slots claimed by the hooks of other libraries (eg. inherited vtable entries)
+    for (auto claimIt = slotClaims.begin(); claimIt != slotClaims.end(); ) {
+        if ((size_t) claimIt->first >= si->base && (size_t) claimIt->first < si->base + si->size)
+            claimIt = slotClaims.erase(claimIt);
+        else
+            claimIt++;
+    }
+    endWriteBatch();
+    destroyLibraryInfo(li);
+    dlclose(lib);
+    lastMapsSize = 0; // the library may get mapped at the same place again; don't skip the next maps update
+}
+
+void HookManager::setInstrumentationEnabled(bool enabled) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    if (enabled && !HookInstrumentation::isSupported()) {
+        log.warn("Hook instrumentation is not supported on this architecture");
+        return;
+    }
+    instrumentationEnabled = enabled;
+}
+
+void HookManager::forEachHook(std::function<void (HookInfo const& hook)> callback) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
+    for (HookSymbol* symbol : getAllSymbols()) {
+        for (HookInfo* hook = symbol->hook; hook != nullptr; hook = hook->parent)
+            callback(*hook);
     }
-    delete hook;
 }
 
-void HookManager::addCustomRef(void** ref, void* lib, std::string const& str) {
+void HookManager::addCustomRef(void** ref, void* lib, SymbolId name) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
     removeCustomRef(ref);
-    HookSymbol* symbol = getSymbol(lib, str, false);
+    HookSymbol* symbol = getSymbol(lib, name, false);
     symbol->customRefs.insert(ref);
     customRefToSymbol[ref] = symbol;
 }
 
 void HookManager::removeCustomRef(void** ref) {
+    std::lock_guard<std::recursive_mutex> lock (mutex);
     if (customRefToSymbol.count(ref) > 0) {
         HookSymbol* sym = customRefToSymbol.at(ref);
         customRefToSymbol.erase(ref);
@@ -2,22 +2,78 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <unordered_set>
 #include <unordered_map>
+#include <mutex>
+#include <functional>
 #include <sys/exec_elf.h>
 #include <tml/log.h>
+#include <tml/modstatichook.h>
+#include "symbolnametable.h"
+#include "hookinstrumentation.h"
+#include "inlinehook.h"
+#include "bytepattern.h"
 
 namespace tml {
 
 class ModLoader;
+class Mod;
 
 class HookManager {
 
 private:
     Log log;
 
-    void findSymbolAndAddTo(std::vector<void*>& arr, Elf32_Addr base, Elf32_Addr soSize, Elf32_Addr off,
-                            Elf32_Addr size, void* sym);
+    // All of the public functions lock this mutex; the patched call sites and the user's original function pointers
+    // are only ever updated using atomic stores, so the game threads calling the hooked functions don't need it.
+    std::recursive_mutex mutex;
+
+    std::vector<char> mapsBuffer, lastMapsBuffer; // the current and the previous contents of /proc/self/maps
+    size_t mapsSize = 0, lastMapsSize = 0;
+    unsigned int mapsGeneration = 0;
+    std::unordered_set<std::string> ignoredPaths; // mapped files we have failed to create a LibraryInfo for
+
+    struct SectionLayoutCacheEntry {
+        long long fileSize, fileTimestamp;
+        Elf32_Off gotOff, gotSize;
+        Elf32_Off gotPltOff, gotPltSize;
+        Elf32_Off dataRelRoOff, dataRelRoSize;
+    };
+    std::string cacheDir;
+    std::unordered_map<std::string, SectionLayoutCacheEntry> sectionLayoutCache; // library path => section layout
+    bool sectionLayoutCacheDirty = false;
+
+    struct HookSiteCacheLibrary {
+        std::string path;
+        long long fileSize, fileTimestamp;
+        std::vector<Elf32_Off> slotOffsets; // relative to the library base
+    };
+    struct HookSiteCacheEntry {
+        long long fileSize, fileTimestamp; // of the library the symbol is looked up in
+        Elf32_Off symbolOffset;
+        std::vector<HookSiteCacheLibrary> libraries; // all of the libraries that have been searched for patch sites
+    };
+    std::map<std::pair<std::string, SymbolId>, HookSiteCacheEntry> hookSiteCache; // { library path, symbol } => entry
+    bool hookSiteCacheDirty = false;
+
+    struct PatternCacheEntry {
+        long long fileSize, fileTimestamp;
+        Elf32_Off offset; // relative to the library base, (Elf32_Off) -1 if there was no match
+    };
+    std::map<std::pair<std::string, std::string>, PatternCacheEntry> patternCache; // { library path, pattern } => entry
+    bool patternCacheDirty = false;
+
+    bool trackingLibraries = false; // set while handling a library load, so that our own dlopen calls are ignored
+
+    void readMaps();
+
+    void loadSectionLayoutCache();
+    void saveSectionLayoutCache();
+    void loadHookSiteCache();
+    void saveHookSiteCache();
+    void loadPatternCache();
+    void savePatternCache();
 
 public:
     struct LibraryMemMap {
@@ -25,41 +81,74 @@ public:
 
         // the original state
         bool r, w, x;
-        bool needsHackyPatchToWork = false;
+        bool needsHackyPatchToWork = false; // mprotect() has failed; the writes go through /proc/self/mem instead
 
         LibraryMemMap(size_t start, size_t end, bool r, bool w, bool x) : start(start), end(end), r(r), w(w), x(x) { }
     };
+    struct HookSymbol;
     struct LibraryInfo {
         void* ptr;
+        unsigned int index; // a dense index of the library, never reused for another library
         std::string path;
+        long long fileSize, fileTimestamp;
 
-        Elf32_Off gotOff = 0, gotSize;
-        Elf32_Off gotPltOff = 0, gotPltSize;
-        Elf32_Off dataRelRoOff = 0, dataRelRoSize;
+        Elf32_Off gotOff = 0, gotSize = 0;
+        Elf32_Off gotPltOff = 0, gotPltSize = 0;
+        Elf32_Off dataRelRoOff = 0, dataRelRoSize = 0;
         std::vector<LibraryMemMap> memMaps;
+        std::vector<std::pair<size_t, size_t>> scannedMaps; // the ranges seen in /proc/self/maps by the last scan
         bool mightNeedHackyPatch = false;
+        unsigned int mapsGeneration = 0; // the last updateLoadedLibs call which has seen this library mapped
+
+        // the slot index is only built once a symbol has to be looked up by scanning, or before the first write to
+        // one of the library's slots (so that it always sees the original pointers)
+        bool slotIndexBuilt = false;
+        std::unordered_map<void*, std::vector<void**>> slotIndex; // resolved pointer => slots that point to it
+        std::unordered_map<void*, HookSymbol*> slotOwners; // resolved pointer => the symbol which has claimed its slots
+
+        bool vtableIndexBuilt = false; // the vtable index is only built once a vtable slot is hooked
+        std::vector<std::pair<void**, size_t>> vtables; // the exported vtables: { address, entry count }, sorted
 
         void addMap(LibraryMemMap mmap);
+
+        /**
+         * Checks if the specified mappings have the same ranges as the ones seen by the last scan.
+         */
+        bool hasScannedMaps(std::vector<LibraryMemMap> const& maps) const;
+
+        LibraryMemMap* findMap(size_t addr);
+
+        /**
+         * Checks if the specified offset (relative to the library base) lies in one of the sections we patch
+         * (.got, .got.plt or .data.rel.ro).
+         */
+        bool isPatchableOffset(Elf32_Addr off) const;
     };
 
-    struct HookSymbol;
     struct HookInfo {
-        HookSymbol* symbol;
+        HookSymbol* symbol; // null while the hook is detached (its library has been released)
         HookInfo* parent = nullptr;
         HookInfo* child = nullptr;
         void* overrideSym;
         void** userOrgSym; // a user code reference to the symbol he'll call as the original function
+        Mod* owner = nullptr; // the mod which has installed this hook, if any
+        HookInstrumentation* instrumentation = nullptr; // only set when instrumentation was enabled
+        bool placeholder = false; // the hook of a mod that is being reloaded; calls pass straight through it
+
+        /**
+         * Returns the function the call sites (or the next hook) should call: the instrumentation thunk if this hook
+         * is instrumented, the override otherwise. Placeholders return the target of the hook below them.
+         */
+        void* getTarget() const;
     };
     struct SymbolLibNameDesc {
         void* lib;
-        std::string name;
+        SymbolId name;
         bool operator==(SymbolLibNameDesc const& s2) const { return (lib == s2.lib && name == s2.name); }
     };
     struct SymbolLibNameDescHash {
         std::size_t operator()(SymbolLibNameDesc const& s) const {
-            std::size_t h1 = std::hash<std::string>()(s.name);
-            std::size_t h2 = std::hash<size_t>()((size_t) s.lib);
-            return h1 ^ (h2 << 1);
+            return ((size_t) s.name * 2654435761U) ^ ((size_t) s.lib >> 2);
         }
     };
     struct HookSymbol {
@@ -70,40 +159,293 @@ public:
         void* originalSym = nullptr;
         void* usedSymbol = nullptr;
 
-        std::unordered_map<void*, std::vector<void*>> usage; // pairs of library pointer => pointers in the GOT table
+        // the patch sites of this symbol, stored as parallel arrays so that retargeting is a single linear loop
+        std::vector<void**> siteSlots;
+        std::vector<unsigned int> siteLibraries; // LibraryInfo::index of the library containing the slot
+        std::vector<void*> siteValues; // the value currently written to the slot
         std::unordered_set<void**> customRefs;
 
+        InlineHook* inlineHook = nullptr; // set if the symbol is hooked by patching the function's code
+
         HookInfo* hook = nullptr;
 
         void useSymbol(HookManager* mgr, void* newSym);
     };
+    struct ObserverDispatcherInfo {
+        void* dispatch;
+        void** original;
+        HookObserverArray** observers;
+    };
+    struct HookObserver {
+        void* callback;
+        bool post;
+        Mod* owner;
+        ObserverDispatcherInfo dispatcher; // the dispatcher compiled into the observer's mod
+    };
+    struct ObserverSet {
+        std::vector<HookObserver> observers;
+        HookInfo* hook = nullptr; // the hook of the dispatcher in use (the one of the first observer)
+    };
+    struct HookRequest {
+        void* lib;
+        SymbolId sym;
+        void* override;
+        void** org;
+        Mod* owner;
+    };
 
-    HookManager(ModLoader* loader);
+    HookManager(ModLoader* loader, std::string cacheDir);
+    ~HookManager();
 
     std::unordered_map<void*, LibraryInfo*> libraries; // library => LibraryInfo
     std::unordered_map<std::string, LibraryInfo*> librariesByPath; // library path => LibraryInfo
+    SymbolNameTable symbolNames;
     std::unordered_map<SymbolLibNameDesc, HookSymbol*, SymbolLibNameDescHash> symbols; // { library, symbol name } => HookSymbol*
     std::unordered_map<void**, HookSymbol*> customRefToSymbol;
-    std::unordered_set<void*> hookedSymbolRefs;
+    // { library, symbol name } => address
+    std::unordered_map<SymbolLibNameDesc, void*, SymbolLibNameDescHash> resolvedSymbols;
+    size_t resolveCacheHits = 0, resolveCacheMisses = 0;
+    std::vector<LibraryInfo*> librariesByIndex; // LibraryInfo::index => LibraryInfo (null once destroyed)
+    std::vector<bool> liveLibraries; // LibraryInfo::index => whether the library is still loaded
+    std::unordered_map<void*, InlineHook*> inlineHooks; // function => its entry patch (never removed)
+    std::unordered_map<void*, HookSymbol*> inlineSymbols; // function => HookSymbol
+    std::unordered_map<void**, HookSymbol*> vtableSymbols; // hooked vtable slot => HookSymbol
+    // { importing library, symbol name } => HookSymbol patching only the slots of that library
+    std::unordered_map<SymbolLibNameDesc, HookSymbol*, SymbolLibNameDescHash> importSymbols;
+    // slot => the vtable or import symbols patching it, from the bottom to the top of the chain; every symbol writing
+    // the slot passes its target to the next one instead, so the one at the top calls through all of the others
+    std::unordered_map<void**, std::vector<HookSymbol*>> slotClaims;
+    std::unordered_map<HookSymbol*, ObserverSet> observerSets;
+
+private:
+    struct PendingWrite {
+        LibraryInfo* library;
+        void** slot;
+        void* value;
+    };
+    // the hooks of a symbol whose library has been released, kept (out of any chain) until the library is loaded
+    // again, as the mods still hold pointers to them
+    struct DetachedSymbol {
+        enum class Kind { SYMBOL, INLINE, VTABLE, IMPORT };
+        Kind kind;
+        std::string libraryPath;
+        SymbolId name; // the vtable name for VTABLE symbols
+        unsigned int vtableIndex = 0;
+        bool allInheriting = false;
+        std::vector<HookInfo*> hooks; // from the bottom of the chain to the top
+    };
+    std::vector<DetachedSymbol> detachedSymbols;
+
+    std::vector<PendingWrite> pendingWrites;
+    int writeBatchDepth = 0;
+    std::unordered_set<HookSymbol*> pendingObserverUpdates; // the symbols whose observers were added in the batch
+    size_t unprotectedPageCount = 0;
+    int procMemFd = -1; // /proc/self/mem, opened once a mapping can't be made writable
+    bool inlinePatchingLocked = false;
+    bool instrumentationEnabled = false;
 
+    void buildSlotIndex(LibraryInfo* li);
+    void ensureSlotIndex(LibraryInfo* li);
+    void addSectionToSlotIndex(LibraryInfo* li, Elf32_Off off, Elf32_Off size);
+    bool readSectionLayout(LibraryInfo* li);
+
+    HookSymbol* findOrCreateSymbol(void* lib, SymbolId name);
+    HookSymbol* getInlineSymbol(void* function, SymbolId name, bool libraryIsNew = false);
+    HookSymbol* getVtableSymbol(void* lib, SymbolId vtableName, unsigned int index, bool allInheriting);
+    HookSymbol* getImportSymbol(void* importer, SymbolId name);
+    HookSymbol* getSlotClaimAbove(HookSymbol* symbol, void** slot);
+    void claimSlot(HookSymbol* symbol, LibraryInfo* li, void** slot);
+    void ensureVtableIndex(LibraryInfo* li);
+    std::vector<HookSymbol*> getAllSymbols() const;
+    void initializeSymbols(std::vector<HookSymbol*> const& pending);
+    HookSiteCacheEntry* findHookSiteCacheEntry(void* lib, SymbolId name);
+    bool addCachedSites(LibraryInfo* li, HookSymbol* symbol, HookSiteCacheLibrary const& cached);
+    void updateHookSiteCacheEntry(HookSymbol* symbol);
+    HookInfo* addHook(HookSymbol* symbol, void* override, void** org, Mod* owner);
+    void refreshChain(HookSymbol* symbol);
+    void applySymbolsToLibraries(std::vector<LibraryInfo*> const& newLibraries);
+    void updateObservers(HookSymbol* symbol);
+    void detachSymbolHooks(HookSymbol* symbol, LibraryInfo* li);
+    void reattachHooks(std::vector<LibraryInfo*> const& newLibraries);
+    void commitWrites();
+    void writeThroughProcMem(std::vector<PendingWrite> const& writes,
+                             std::vector<std::pair<void**, void*>>& failedWrites);
+    void forgetFailedWrites(std::vector<std::pair<void**, void*>>& failedWrites);
+    bool openProcMem();
+    void writeCode(LibraryInfo* li, void* addr, const void* data, size_t size);
+    void* resolveSymbol(void* lib, SymbolId name);
+
+    static void publishPointer(void** ptr, void* value) { __atomic_store_n(ptr, value, __ATOMIC_RELEASE); }
+
+public:
+    /**
+     * Parses /proc/self/maps and creates (or destroys) the library infos of libraries that got mapped (or unmapped)
+     * since the last call. Only the libraries whose mappings have changed are processed; this is a no-op if the
+     * mappings didn't change at all.
+     */
     void updateLoadedLibs();
 
+    /**
+     * Hooks dlopen (and android_dlopen_ext, if available) so that the libraries loaded by the tracked libraries are
+     * registered (and the active hooks applied to them) as soon as they are loaded, without rescanning all of the
+     * mappings. Libraries loaded from other places (eg. System.loadLibrary) still need an updateLoadedLibs call.
+     */
+    void enableLibraryTracking();
+
+    /**
+     * Registers the specified newly loaded library and the libraries loaded together with it as its dependencies,
+     * ie. the libraries added to the linker's list after previousTail (its last library before the dlopen call).
+     */
+    void onLibraryLoaded(void* handle, void* previousTail);
+
+    /**
+     * Starts a write batch: slot writes are only queued until the matching endWriteBatch() call, so that every page
+     * is made writable only once per batch. Batches can be nested.
+     */
+    void beginWriteBatch();
+
+    void endWriteBatch();
+
+    /**
+     * Writes the specified value to a patch site of the specified library. The pages containing patch sites are made
+     * writable only for the duration of the write and their original protection is restored afterwards.
+     */
+    void writeSlot(LibraryInfo* library, void** slot, void* value);
+
+    /**
+     * Returns how many pages have been temporarily made writable so far.
+     */
+    size_t getUnprotectedPageCount() const { return unprotectedPageCount; }
+
+    /**
+     * Returns the sum of the Private_Dirty memory of all of the known libraries' mappings (from /proc/self/smaps).
+     */
+    size_t getLibrariesPrivateDirtyBytes();
+
     LibraryInfo* createLibraryInfo(std::string const& path);
 
     void destroyLibraryInfo(LibraryInfo* libraryInfo);
 
-    HookSymbol* getSymbol(void* lib, std::string const& str, bool initialize = true);
+    /**
+     * Returns the id of the specified symbol name. The same name always maps to the same id; this only allocates
+     * memory the first time a name is seen.
+     */
+    SymbolId internSymbol(const char* name, size_t length);
+
+    SymbolId internSymbol(const char* name) { return internSymbol(name, strlen(name)); }
+
+    std::string const& getSymbolName(SymbolId id) const { return symbolNames.getName(id); }
+
+    HookSymbol* getSymbol(void* lib, SymbolId name, bool initialize = true);
 
     void destroySymbol(HookSymbol* symbol);
 
-    HookInfo* hook(void* lib, std::string const& sym, void* override, void** org);
+    HookInfo* hook(void* lib, SymbolId sym, void* override, void** org, Mod* owner = nullptr);
+
+    /**
+     * Installs all of the specified hooks at once: the patch sites of every library are looked up only once for all
+     * of the symbols and every symbol is written only once. Returns the created hooks in the same order as the
+     * requests; requests whose symbol couldn't be found are logged and returned as null.
+     */
+    std::vector<HookInfo*> hookMany(std::vector<HookRequest> const& requests);
+
+    /**
+     * Hooks a function by patching its entry instead of the pointers used to call it, so that the direct calls (eg.
+     * the ones from within its own library) are redirected as well. The hook is chained with the other inline hooks
+     * of the same function just like the regular hooks are; the name is only used for logging.
+     */
+    HookInfo* hookInline(void* function, SymbolId name, void* override, void** org, Mod* owner = nullptr);
+
+    /**
+     * Disallows patching the entry of any more functions, as the entry is written non-atomically and the game threads
+     * might be running any function once they've started. The functions whose entry is already patched can still be
+     * hooked inline, as that only writes their entry slot.
+     */
+    void lockInlinePatching() { inlinePatchingLocked = true; }
+
+    /**
+     * Hooks a virtual function by patching only the specified entry of the specified vtable, instead of every pointer
+     * to the function. If allInheriting is set, the same entry is patched in the exported vtables of all of the
+     * derived classes which haven't overridden the function (ie. contain the same pointer at the same index); the
+     * derived classes are found by their typeinfo, and only the ones having the class as a primary base are patched.
+     */
+    HookInfo* hookVirtual(void* lib, SymbolId vtableName, unsigned int index, void* override, void** org,
+                          bool allInheriting = false, Mod* owner = nullptr);
+
+    /**
+     * Hooks a function only for the calls made by the specified library, by patching only the slots of that library
+     * (the functions it imports). The function is looked up globally, like the importing library's linker would.
+     */
+    HookInfo* hookImports(void* importer, SymbolId name, void* override, void** org, Mod* owner = nullptr);
+
+    /**
+     * Adds an observer of the specified symbol. All of the observers of a symbol are called by a single dispatcher
+     * hook (in the order they were added), which calls the original function only once. Within a write batch, the
+     * observers only take effect when the batch ends.
+     */
+    void addObserver(void* lib, SymbolId name, HookObserver const& observer);
+
+    /**
+     * Removes all of the observers added by the specified mod. If the dispatcher in use came from that mod, another
+     * observing mod's dispatcher takes its place in the hook chain.
+     */
+    void removeObservers(Mod* owner);
+
+    /**
+     * Looks up the address of a symbol; throws a std::runtime_error if it doesn't exist.
+     */
+    void* findSymbol(void* lib, SymbolId name);
+
+    /**
+     * Finds the first match of the pattern in the executable mappings of the specified library, or returns null if
+     * there is none. The results are cached (also across restarts) until the library file changes.
+     */
+    void* findPattern(void* lib, BytePattern const& pattern);
 
     void unhook(HookInfo* hook);
 
-    void addCustomRef(void** ref, void* lib, std::string const& str);
+    /**
+     * Enables or disables the call instrumentation of the hooks installed by mods from now on. Instrumented hooks are
+     * called through a thunk recording the call count and time; hooks installed while this is disabled have no
+     * overhead.
+     */
+    void setInstrumentationEnabled(bool enabled);
+
+    bool isInstrumentationEnabled() const { return instrumentationEnabled; }
+
+    /**
+     * Calls the specified function for each of the installed hooks, with the hook manager locked.
+     */
+    void forEachHook(std::function<void (HookInfo const& hook)> callback);
+
+    /**
+     * Turns all of the hooks installed by the specified mod into placeholders that pass the calls through. The
+     * placeholders keep their position in the hook chains: hooks the mod installs later on the same symbols take
+     * their place, so the order relative to other mods' hooks is preserved.
+     */
+    void detachHooks(Mod* owner);
+
+    /**
+     * Removes the placeholders of the specified mod that weren't replaced by a new hook.
+     */
+    void removePlaceholders(Mod* owner);
+
+    /**
+     * Drops the library info of the specified library together with the custom refs stored in its memory and the
+     * symbols looked up in it, and releases our reference to it, so that it can be unloaded. The hooks of the mods on
+     * the dropped symbols are detached and installed again once a library with the same path gets loaded.
+     */
+    void releaseLibrary(void* lib);
+
+    void addCustomRef(void** ref, void* lib, SymbolId name);
 
     void removeCustomRef(void** ref);
 
+    /**
+     * Writes the persistent caches (if they have changed) to the cache directory.
+     */
+    void saveCaches();
+
 };
 
 }
@@ -0,0 +1,447 @@
+#include "inlinehook.h"
+
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include "codepool.h"
+
+using namespace tml;
+
+static const size_t TRAMPOLINE_SIZE = 128;
+
+namespace {
+
+/**
+ * Assembles code into a buffer, computing the PC-relative fields for the address the code will be written to.
+ */
+struct CodeWriter {
+    uint8_t* base;
+    uintptr_t address;
+    size_t size = 0;
+    size_t capacity;
+
+    CodeWriter(void* base, uintptr_t address, size_t capacity) : base((uint8_t*) base), address(address),
+                                                                 capacity(capacity) { }
+
+    uintptr_t pc() const { return address + size; }
+
+    void put(const void* data, size_t len) {
+        if (size + len > capacity)
+            throw std::runtime_error("The relocated prologue doesn't fit into the trampoline");
+        memcpy(base + size, data, len);
+        size += len;
+    }
+    void put8(uint8_t v) { put(&v, 1); }
+    void put16(uint16_t v) { put(&v, 2); }
+    void put32(uint32_t v) { put(&v, 4); }
+};
+
+uint16_t read16(const uint8_t* p) {
+    uint16_t ret;
+    memcpy(&ret, p, 2);
+    return ret;
+}
+
+uint32_t read32(const uint8_t* p) {
+    uint32_t ret;
+    memcpy(&ret, p, 4);
+    return ret;
+}
+
+#if defined(__i386__)
+
+size_t getModRmLength(const uint8_t* p) {
+    int mod = p[0] >> 6, rm = p[0] & 7;
+    if (mod == 3)
+        return 1;
+    size_t len = 1;
+    if (rm == 4) {
+        len++; // SIB
+        if (mod == 0 && (p[1] & 7) == 5)
+            len += 4;
+    } else if (mod == 0 && rm == 5) {
+        len += 4;
+    }
+    if (mod == 1)
+        len += 1;
+    else if (mod == 2)
+        len += 4;
+    return len;
+}
+
+/**
+ * Returns the length of the instruction at the specified address, or 0 if it isn't one we know how to relocate.
+ */
+size_t getX86InstructionLength(const uint8_t* code) {
+    const uint8_t* p = code;
+    bool operandSize16 = false;
+    while (true) {
+        uint8_t b = *p;
+        if (b == 0x66)
+            operandSize16 = true;
+        else if (b == 0x67)
+            return 0; // 16-bit addressing
+        else if (b != 0xf0 && b != 0xf2 && b != 0xf3 && b != 0x26 && b != 0x2e && b != 0x36 && b != 0x3e &&
+                b != 0x64 && b != 0x65)
+            break;
+        p++;
+    }
+    size_t immSize = (operandSize16 ? 2 : 4);
+    size_t prefixLen = (size_t) (p - code);
+    uint8_t op = *p++;
+    if (op == 0x0f) {
+        uint8_t op2 = *p++;
+        size_t len = prefixLen + 2;
+        if (op2 >= 0x80 && op2 <= 0x8f)
+            return len + 4; // jcc rel32
+        if (op2 >= 0xc8 && op2 <= 0xcf)
+            return len; // bswap
+        if ((op2 >= 0x70 && op2 <= 0x73) || op2 == 0xa4 || op2 == 0xac || op2 == 0xba || op2 == 0xc2 ||
+                (op2 >= 0xc4 && op2 <= 0xc6))
+            return len + getModRmLength(p) + 1;
+        if ((op2 >= 0x10 && op2 <= 0x1f) || (op2 >= 0x28 && op2 <= 0x2f) || (op2 >= 0x40 && op2 <= 0x6f) ||
+                op2 == 0x7e || op2 == 0x7f || (op2 >= 0x90 && op2 <= 0x9f) || op2 == 0xa3 || op2 == 0xab ||
+                op2 == 0xaf || op2 == 0xb0 || op2 == 0xb1 || op2 == 0xb6 || op2 == 0xb7 || op2 == 0xbe ||
+                op2 == 0xbf || (op2 >= 0xd0 && op2 <= 0xfe))
+            return len + getModRmLength(p);
+        return 0;
+    }
+    size_t len = prefixLen + 1;
+    if (op < 0x40) {
+        switch (op & 7) {
+            case 0: case 1: case 2: case 3:
+                return len + getModRmLength(p);
+            case 4:
+                return len + 1;
+            case 5:
+                return len + immSize;
+            default:
+                return len; // segment pushes/pops and BCD adjustments
+        }
+    }
+    if (op <= 0x61 || (op >= 0x90 && op <= 0x99) || (op >= 0x9b && op <= 0x9f) || (op >= 0xa4 && op <= 0xa7) ||
+            (op >= 0xaa && op <= 0xaf) || op == 0xc9 || (op >= 0xf8 && op <= 0xfd) || (op >= 0x6c && op <= 0x6f))
+        return len;
+    if (op == 0x62 || op == 0x63 || (op >= 0x84 && op <= 0x8f) || (op >= 0xd0 && op <= 0xd3) ||
+            (op >= 0xd8 && op <= 0xdf) || op == 0xfe || op == 0xff)
+        return len + getModRmLength(p);
+    if (op == 0x68 || op == 0xa9 || (op >= 0xb8 && op <= 0xbf))
+        return len + immSize;
+    if (op == 0x6a || op == 0xa8 || (op >= 0xb0 && op <= 0xb7) || (op >= 0x70 && op <= 0x7f) || op == 0xeb)
+        return len + 1;
+    if (op == 0x69 || op == 0x81 || op == 0xc7)
+        return len + getModRmLength(p) + immSize;
+    if (op == 0x6b || op == 0x80 || op == 0x82 || op == 0x83 || op == 0xc0 || op == 0xc1 || op == 0xc6)
+        return len + getModRmLength(p) + 1;
+    if (op >= 0xa0 && op <= 0xa3)
+        return len + 4;
+    if (op == 0xe8 || op == 0xe9)
+        return len + 4;
+    if (op == 0xc8)
+        return len + 3;
+    if (op == 0xf6 || op == 0xf7) {
+        int reg = (p[0] >> 3) & 7;
+        return len + getModRmLength(p) + (reg < 2 ? (op == 0xf6 ? 1 : immSize) : 0);
+    }
+    return 0; // returns, interrupts, far branches and loops
+}
+
+/**
+ * Checks if the function at the specified address is a PIC base thunk: mov (%esp), %reg; ret.
+ */
+bool isPcThunk(const uint8_t* p, int& reg) {
+    if (p[0] != 0x8b || (p[1] & 0xc7) != 0x04 || p[2] != 0x24 || p[3] != 0xc3)
+        return false;
+    reg = (p[1] >> 3) & 7;
+    return true;
+}
+
+void relocateX86Instruction(const uint8_t* insn, size_t len, uintptr_t patchStart, uintptr_t patchEnd,
+                            CodeWriter& out) {
+    uintptr_t next = (uintptr_t) insn + len;
+    int32_t rel;
+    bool isJcc8 = (insn[0] >= 0x70 && insn[0] <= 0x7f), isJcc32 = (insn[0] == 0x0f && insn[1] >= 0x80 &&
+                                                                   insn[1] <= 0x8f);
+    if (insn[0] == 0xe8) {
+        rel = (int32_t) read32(&insn[1]);
+        uintptr_t target = next + rel;
+        int reg;
+        if (rel == 0) {
+            // call to the next instruction, used to get the PC: push the original address instead
+            out.put8(0x68);
+            out.put32((uint32_t) next);
+        } else if (isPcThunk((const uint8_t*) target, reg)) {
+            out.put8((uint8_t) (0xb8 + reg)); // mov $next, %reg
+            out.put32((uint32_t) next);
+        } else {
+            out.put8(0xe8);
+            out.put32((uint32_t) (target - (out.pc() + 4)));
+        }
+        return;
+    }
+    if (insn[0] == 0xe9 || insn[0] == 0xeb || isJcc8 || isJcc32) {
+        if (insn[0] == 0xe9 || isJcc32)
+            rel = (int32_t) read32(&insn[len - 4]);
+        else
+            rel = (int8_t) insn[1];
+        uintptr_t target = next + rel;
+        if (target >= patchStart && target < patchEnd)
+            throw std::runtime_error("A branch targets the patched instructions");
+        if (insn[0] == 0xe9 || insn[0] == 0xeb) {
+            out.put8(0xe9);
+        } else {
+            out.put8(0x0f);
+            out.put8((uint8_t) (isJcc8 ? 0x80 + (insn[0] - 0x70) : insn[1]));
+        }
+        out.put32((uint32_t) (target - (out.pc() + 4)));
+        return;
+    }
+    out.put(insn, len);
+}
+
+void createX86Hook(InlineHook* hook, uint8_t* func) {
+    const size_t entrySize = 6; // jmp *slot
+    size_t patchSize = 0;
+    while (patchSize < entrySize) {
+        size_t len = getX86InstructionLength(func + patchSize);
+        if (len == 0)
+            throw std::runtime_error("Unsupported instruction in the function prologue");
+        patchSize += len;
+    }
+    uint8_t* trampoline = (uint8_t*) CodePool::instance.allocate(TRAMPOLINE_SIZE);
+    if (trampoline == nullptr)
+        throw std::runtime_error("Failed to allocate the trampoline");
+    uint8_t trampolineCode[TRAMPOLINE_SIZE];
+    CodeWriter out (trampolineCode, (uintptr_t) trampoline, TRAMPOLINE_SIZE);
+    for (size_t off = 0; off < patchSize; ) {
+        size_t len = getX86InstructionLength(func + off);
+        relocateX86Instruction(func + off, len, (uintptr_t) func, (uintptr_t) func + patchSize, out);
+        off += len;
+    }
+    out.put8(0xe9);
+    out.put32((uint32_t) ((uintptr_t) func + patchSize - (out.pc() + 4)));
+    CodePool::instance.write(trampoline, trampolineCode, out.size);
+    void** slot = new void*(trampoline); // written whenever the hook chain changes, so it can't be in the code pool
+
+    uint8_t* entry = hook->entryCode;
+    entry[0] = 0xff;
+    entry[1] = 0x25;
+    uint32_t slotAddr = (uint32_t) (uintptr_t) slot;
+    memcpy(&entry[2], &slotAddr, 4);
+    memset(&entry[entrySize], 0x90, patchSize - entrySize);
+
+    hook->entry = func;
+    hook->entrySize = patchSize;
+    hook->trampoline = trampoline;
+    hook->entrySlot = slot;
+}
+
+#elif defined(__arm__)
+
+/**
+ * Loads the specified value to a register: ldr.w reg, [pc, #4]; b.n skip; nop; .word value
+ */
+void putThumbLiteralLoad(CodeWriter& out, int reg, uint32_t value) {
+    if (out.pc() & 2)
+        out.put16(0xbf00);
+    out.put16(0xf8df);
+    out.put16((uint16_t) ((reg << 12) | 4));
+    out.put16(0xe002);
+    out.put16(0xbf00);
+    out.put32(value);
+}
+
+void putThumbJump(CodeWriter& out, uint32_t target) {
+    if (out.pc() & 2)
+        out.put16(0xbf00);
+    out.put16(0xf8df); // ldr.w pc, [pc, #0]
+    out.put16(0xf000);
+    out.put32(target);
+}
+
+void relocateThumb16(uint16_t hw, uintptr_t pc, CodeWriter& out) {
+    if ((hw & 0xf800) == 0x4800) { // ldr rt, [pc, #imm]
+        putThumbLiteralLoad(out, (hw >> 8) & 7, read32((const uint8_t*) ((pc & ~3) + (hw & 0xff) * 4)));
+    } else if ((hw & 0xf800) == 0xa000) { // adr rd, #imm
+        putThumbLiteralLoad(out, (hw >> 8) & 7, (uint32_t) ((pc & ~3) + (hw & 0xff) * 4));
+    } else if ((hw & 0xfc00) == 0x4400) { // add, cmp, mov, bx with high registers
+        int op = (hw >> 8) & 3, rm = (hw >> 3) & 0xf, rdn = (hw & 7) | ((hw >> 4) & 8);
+        if (op == 3 || rdn == 15)
+            throw std::runtime_error("Unsupported branch in the function prologue");
+        if (rm == 15) {
+            if (op != 0 || rdn == 12)
+                throw std::runtime_error("Unsupported PC-relative instruction in the function prologue");
+            putThumbLiteralLoad(out, 12, (uint32_t) pc);
+            out.put16((uint16_t) (0x4400 | ((rdn & 8) << 4) | (12 << 3) | (rdn & 7))); // add rdn, ip
+        } else {
+            out.put16(hw);
+        }
+    } else if ((hw & 0xf000) == 0xd000 || (hw & 0xf800) == 0xe000 || (hw & 0xf500) == 0xb100 ||
+            ((hw & 0xff00) == 0xbf00 && (hw & 0xf) != 0) || (hw & 0xff00) == 0xbd00) {
+        throw std::runtime_error("Unsupported branch in the function prologue");
+    } else {
+        out.put16(hw);
+    }
+}
+
+void relocateThumb32(uint16_t hw1, uint16_t hw2, uintptr_t pc, CodeWriter& out) {
+    if ((hw1 & 0xf800) == 0xf000 && (hw2 & 0x8000) != 0) {
+        if ((hw2 & 0xc000) != 0xc000)
+            throw std::runtime_error("Unsupported branch in the function prologue");
+        // bl or blx; call the target through ip
+        uint32_t s = (hw1 >> 10) & 1, i1 = !(((hw2 >> 13) & 1) ^ s), i2 = !(((hw2 >> 11) & 1) ^ s);
+        int32_t imm = (int32_t) ((s ? 0xff000000 : 0) | (i1 << 23) | (i2 << 22) | ((hw1 & 0x3ff) << 12) |
+                                 ((hw2 & 0x7ff) << 1));
+        uint32_t target;
+        if (hw2 & 0x1000)
+            target = (uint32_t) (pc + imm) | 1;
+        else
+            target = (uint32_t) ((pc & ~3) + imm) & ~3;
+        putThumbLiteralLoad(out, 12, target);
+        out.put16(0x47e0); // blx ip
+        return;
+    }
+    if ((hw1 & 0xff7f) == 0xf85f) { // ldr.w rt, [pc, #+-imm12]
+        int rt = hw2 >> 12;
+        if (rt == 15)
+            throw std::runtime_error("Unsupported branch in the function prologue");
+        uintptr_t addr = (pc & ~3) + ((hw1 & 0x80) ? (hw2 & 0xfff) : -(hw2 & 0xfff));
+        putThumbLiteralLoad(out, rt, read32((const uint8_t*) addr));
+        return;
+    }
+    bool isMovImmediate = (hw1 & 0xfb70) == 0xf240; // movw/movt; the low bits are a part of the immediate
+    bool isMovModified = ((hw1 & 0xfa00) == 0xf000 || (hw1 & 0xfe00) == 0xea00) && (((hw1 >> 5) & 0xe) == 2);
+    if ((hw1 & 0xf) == 0xf && !isMovImmediate && !isMovModified)
+        throw std::runtime_error("Unsupported PC-relative instruction in the function prologue");
+    if (((hw1 & 0xffd0) == 0xe890 || (hw1 & 0xffd0) == 0xe910) && (hw2 & 0x8000) != 0)
+        throw std::runtime_error("Unsupported branch in the function prologue"); // ldm with pc
+    if ((hw1 & 0xff70) == 0xf850 && (hw2 >> 12) == 15)
+        throw std::runtime_error("Unsupported branch in the function prologue"); // ldr pc
+    out.put16(hw1);
+    out.put16(hw2);
+}
+
+void relocateArm(uint32_t insn, uintptr_t pc, CodeWriter& out) {
+    uint32_t cond = insn >> 28;
+    if ((insn & 0x0e000000) == 0x0a000000) {
+        int32_t imm = ((int32_t) (insn << 8)) >> 6;
+        uint32_t target;
+        if (cond == 0xf)
+            target = (uint32_t) (pc + imm + ((insn >> 23) & 2)) | 1; // blx to Thumb code
+        else if (cond == 0xe && (insn & 0x01000000) != 0)
+            target = (uint32_t) (pc + imm); // bl
+        else
+            throw std::runtime_error("Unsupported branch in the function prologue");
+        out.put32(0xe28fe004); // add lr, pc, #4
+        out.put32(0xe51ff004); // ldr pc, [pc, #-4]
+        out.put32(target);
+        return;
+    }
+    int rn = (insn >> 16) & 0xf, rd = (insn >> 12) & 0xf;
+    if ((insn & 0x0f7f0000) == 0x051f0000) { // ldr rt, [pc, #+-imm12]
+        if (cond != 0xe || rd == 15)
+            throw std::runtime_error("Unsupported PC-relative instruction in the function prologue");
+        uintptr_t addr = pc + ((insn & 0x00800000) ? (insn & 0xfff) : -(insn & 0xfff));
+        out.put32(0xe59f0000 | (rd << 12)); // ldr rt, [pc, #0]
+        out.put32(0xea000000); // b over the literal
+        out.put32(read32((const uint8_t*) addr));
+        return;
+    }
+    if ((insn & 0x0fff0ff0) == 0x008f0000) { // add rd, pc, rm
+        int rm = insn & 0xf;
+        if (cond != 0xe || rd == 12 || rd == 15 || rm == 12 || rm == 15)
+            throw std::runtime_error("Unsupported PC-relative instruction in the function prologue");
+        out.put32(0xe59fc000); // ldr ip, [pc, #0]
+        out.put32(0xea000000);
+        out.put32((uint32_t) pc);
+        out.put32(0xe08c0000 | (rd << 12) | rm); // add rd, ip, rm
+        return;
+    }
+    if (rn == 15 || rd == 15)
+        throw std::runtime_error("Unsupported PC-relative instruction in the function prologue");
+    out.put32(insn);
+}
+
+void createArmHook(InlineHook* hook, void* function) {
+    bool thumb = ((uintptr_t) function & 1) != 0;
+    uint8_t* func = (uint8_t*) ((uintptr_t) function & ~1);
+    uint8_t* trampoline = (uint8_t*) CodePool::instance.allocate(TRAMPOLINE_SIZE);
+    uint32_t* stub = (uint32_t*) CodePool::instance.allocate(12, 4);
+    if (trampoline == nullptr || stub == nullptr)
+        throw std::runtime_error("Failed to allocate the trampoline");
+    uint8_t trampolineCode[TRAMPOLINE_SIZE];
+    CodeWriter out (trampolineCode, (uintptr_t) trampoline, TRAMPOLINE_SIZE);
+    size_t entrySize, patchSize = 0;
+    if (thumb) {
+        entrySize = ((uintptr_t) func & 2) ? 10 : 8;
+        while (patchSize < entrySize) {
+            uint8_t* insn = func + patchSize;
+            uint16_t hw = read16(insn);
+            if ((hw & 0xe000) == 0xe000 && (hw & 0x1800) != 0) {
+                relocateThumb32(hw, read16(insn + 2), (uintptr_t) insn + 4, out);
+                patchSize += 4;
+            } else {
+                relocateThumb16(hw, (uintptr_t) insn + 4, out);
+                patchSize += 2;
+            }
+        }
+        putThumbJump(out, (uint32_t) ((uintptr_t) func + patchSize) | 1);
+    } else {
+        entrySize = 8;
+        for ( ; patchSize < entrySize; patchSize += 4)
+            relocateArm(read32(func + patchSize), (uintptr_t) func + patchSize + 8, out);
+        out.put32(0xe51ff004); // ldr pc, [pc, #-4]
+        out.put32((uint32_t) ((uintptr_t) func + patchSize));
+    }
+    CodePool::instance.write(trampoline, trampolineCode, out.size);
+    void* trampolineEntry = (void*) ((uintptr_t) trampoline | (thumb ? 1 : 0));
+
+    // the entry jumps to an ARM stub loading the target from the entry slot (written whenever the hook chain
+    // changes, so it can't be in the code pool): ldr ip, [pc, #0]; ldr pc, [ip]; .word slot
+    void** slot = new void*(trampolineEntry);
+    uint32_t stubCode[3] = {0xe59fc000, 0xe59cf000, (uint32_t) (uintptr_t) slot};
+    CodePool::instance.write(stub, stubCode, sizeof(stubCode));
+
+    CodeWriter entry (hook->entryCode, (uintptr_t) func, sizeof(hook->entryCode));
+    if (thumb) {
+        if ((uintptr_t) func & 2)
+            entry.put16(0xbf00);
+        entry.put16(0xf8df); // ldr.w pc, [pc, #0]
+        entry.put16(0xf000);
+        entry.put32((uint32_t) (uintptr_t) stub);
+        while (entry.size < patchSize)
+            entry.put16(0xbf00);
+    } else {
+        entry.put32(0xe51ff004); // ldr pc, [pc, #-4]
+        entry.put32((uint32_t) (uintptr_t) stub);
+    }
+
+    hook->entry = func;
+    hook->entrySize = patchSize;
+    hook->trampoline = trampolineEntry;
+    hook->entrySlot = slot;
+}
+
+#endif
+
+}
+
+InlineHook* InlineHook::create(void* function) {
+#if defined(__i386__) || defined(__arm__)
+    InlineHook* hook = new InlineHook();
+    hook->function = function;
+    try {
+#if defined(__i386__)
+        createX86Hook(hook, (uint8_t*) function);
+#else
+        createArmHook(hook, function);
+#endif
+    } catch (...) {
+        delete hook;
+        throw;
+    }
+    return hook;
+#else
+    throw std::runtime_error("Inline hooks are not supported on this architecture");
+#endif
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tml {
+
+/**
+ * An inline patch of a function's entry. The first instructions of the function are replaced with a jump through a
+ * pointer (the entry slot), so that all of the calls to the function, including the direct ones, can be redirected by
+ * just writing the slot. The replaced instructions are relocated into a trampoline, which behaves like the original
+ * function; the entry slot initially points to it.
+ *
+ * Supported on x86 and ARM (both ARM and Thumb-2 functions). The entry is written non-atomically, so the function
+ * must not be running on another thread while it is being written; writing it is left to the HookManager, which knows
+ * the protection of the mapping and when the game threads might be running.
+ */
+struct InlineHook {
+    void* function;
+    void* trampoline;
+    void** entrySlot;
+    void* entry; // the address the entry code has to be written to (the function without the Thumb bit)
+    uint8_t entryCode[32]; // the jump replacing the function's first instructions
+    size_t entrySize;
+
+    /**
+     * Creates the trampoline and the entry code of the specified function (for Thumb functions the address must have
+     * the lowest bit set, as returned by dlsym), without writing the entry. Throws a std::runtime_error if the
+     * prologue can't be relocated or the trampoline can't be written.
+     */
+    static InlineHook* create(void* function);
+};
+
+}
@@ -4,6 +4,7 @@
 #include <tml/modloader.h>
 #include "hookmanager.h"
 #include "fileutil.h"
+#include "tracing.h"
 
 using namespace tml;
 
@@ -14,10 +15,17 @@ Mod::Mod(ModLoader* loader, std::unique_ptr<ModResources> resources) : loader(lo
     FileUtil::createDirs(dataPath);
 }
 
+Mod::Mod(ModLoader* loader, std::unique_ptr<ModResources> resources, ModMeta const& meta) :
+        loader(loader), resources(std::move(resources)), meta(meta), log(loader, meta.getName()) {
+    dataPath = loader->getModDataStoragePath() + meta.getId() + "/";
+    FileUtil::createDirs(dataPath);
+}
+
 void Mod::load() {
     if (loaded)
         return;
-    StaticHookManager::currentMod = this;
+    TraceScope trace ("loadMod", meta.getId());
+    StaticHookManager::setCurrentMod(this);
     for (const ModCode& code : meta.getCode()) {
         ModCodeLoader* codeLoader = loader->getCodeLoader(code.loaderName);
         if (codeLoader == nullptr) {
@@ -33,48 +41,105 @@ void Mod::load() {
             loader->getLog().error("Failed to load mod code '%s' from the mod %s", code.codePath.c_str(),
                                    code.loaderName.c_str());
     }
-    StaticHookManager::currentMod = nullptr;
+    StaticHookManager::setCurrentMod(nullptr);
     loaded = true;
 }
 
 void Mod::init() {
     if (initialized)
         return;
-    for (auto& hk : queuedHooks) {
-        void* lib = getMCPELibrary();
-        if (hk.lib.length() > 0)
-            lib = dlopen(hk.lib.c_str(), RTLD_LAZY);
-        hook(lib, hk.sym.c_str(), hk.func, hk.org);
-    }
-    queuedHooks.clear();
+    TraceScope trace ("initMod", meta.getId());
+    loader->applyQueuedHooks({this});
+    if (queuedHooks.size() > 0 || queuedObservers.size() > 0)
+        throw std::runtime_error("Failed to install some of the mod's hooks");
     for (auto& code : loadedCode) {
         code->init();
     }
     initialized = true;
 }
 
+void Mod::unload() {
+    if (!loaded)
+        return;
+    for (auto& code : loadedCode)
+        code->unload();
+    loadedCode.clear();
+    queuedHooks.clear();
+    queuedObservers.clear();
+    loaded = false;
+    initialized = false;
+}
+
 void* Mod::getMCPELibrary() const {
     return loader->mcpeLib;
 }
 
-void Mod::queueHook(const std::string& lib, const std::string& sym, void* func, void** orig) {
-    queuedHooks.push_back({lib, sym, func, orig});
+void Mod::queueHook(const std::string& lib, const char* sym, size_t symLength, void* func, void** orig) {
+    queuedHooks.push_back({lib, loader->hookManager->internSymbol(sym, symLength), func, orig});
+}
+
+void Mod::queueObserver(const std::string& lib, const char* sym, size_t symLength, void* dispatch, void** original,
+                        HookObserverArray** observers, void* callback, bool post) {
+    queuedObservers.push_back({lib, loader->hookManager->internSymbol(sym, symLength), dispatch, original, observers,
+                               callback, post});
 }
 
 ModHook* Mod::hook(void* lib, const char* str, void* func, void** orig) {
-    return (ModHook*) (void*) loader->hookManager->hook(lib, str, func, orig);
+    return (ModHook*) (void*) loader->hookManager->hook(lib, loader->hookManager->internSymbol(str), func, orig,
+                                                         this);
 }
 
 ModHook* Mod::hook(const char* str, void* func, void** orig) {
     return hook(getMCPELibrary(), str, func, orig);
 }
 
+ModHook* Mod::hookInline(void* lib, const char* str, void* func, void** orig) {
+    HookManager* hookManager = loader->hookManager;
+    SymbolId name = hookManager->internSymbol(str);
+    return (ModHook*) (void*) hookManager->hookInline(hookManager->findSymbol(lib, name), name, func, orig, this);
+}
+
+ModHook* Mod::hookInline(const char* str, void* func, void** orig) {
+    return hookInline(getMCPELibrary(), str, func, orig);
+}
+
+ModHook* Mod::hookInlineAt(void* function, void* func, void** orig) {
+    char name[32];
+    snprintf(name, sizeof(name), "%p", function);
+    return (ModHook*) (void*) loader->hookManager->hookInline(function, loader->hookManager->internSymbol(name), func,
+                                                               orig, this);
+}
+
+ModHook* Mod::hookImportsOf(void* lib, const char* str, void* func, void** orig) {
+    HookManager* hookManager = loader->hookManager;
+    return (ModHook*) (void*) hookManager->hookImports(lib, hookManager->internSymbol(str), func, orig, this);
+}
+
+ModHook* Mod::hookVirtual(void* lib, const char* vtable, unsigned int index, void* func, void** orig,
+                          bool allInheriting) {
+    HookManager* hookManager = loader->hookManager;
+    return (ModHook*) (void*) hookManager->hookVirtual(lib, hookManager->internSymbol(vtable), index, func, orig,
+                                                       allInheriting, this);
+}
+
+ModHook* Mod::hookVirtual(const char* vtable, unsigned int index, void* func, void** orig, bool allInheriting) {
+    return hookVirtual(getMCPELibrary(), vtable, index, func, orig, allInheriting);
+}
+
+void* Mod::findPattern(void* lib, const char* pattern) {
+    return loader->hookManager->findPattern(lib, BytePattern(pattern));
+}
+
+void* Mod::findPattern(const char* pattern) {
+    return findPattern(getMCPELibrary(), pattern);
+}
+
 void Mod::removeHook(ModHook* h) {
     loader->hookManager->unhook((HookManager::HookInfo*) (void*) h);
 }
 
 void Mod::resolveSymbol(void* lib, const char* str, void** ptr) {
-    loader->hookManager->addCustomRef(ptr, lib, str);
+    loader->hookManager->addCustomRef(ptr, lib, loader->hookManager->internSymbol(str));
 }
 
 void Mod::resolveSymbol(const char* str, void** ptr) {
@@ -0,0 +1,173 @@
+#include "modheaptracker.h"
+
+#include <cstdlib>
+#include <malloc.h>
+#include <algorithm>
+#include <linkerutils/linker.h>
+
+using namespace tml;
+
+ModHeapTracker::LibraryList* ModHeapTracker::trackedLibraries = nullptr;
+
+ModHeapTracker::TrackedLibrary* ModHeapTracker::findLibrary(void* address) {
+    LibraryList* list = __atomic_load_n(&trackedLibraries, __ATOMIC_ACQUIRE);
+    if (list == nullptr)
+        return nullptr;
+    size_t lo = 0, hi = list->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((size_t) address < list->libraries[mid]->start)
+            hi = mid;
+        else if ((size_t) address >= list->libraries[mid]->end)
+            lo = mid + 1;
+        else
+            return list->libraries[mid];
+    }
+    return nullptr;
+}
+
+static void countAllocation(ModHeapTracker::Counters* counters, void* ptr) {
+    __atomic_fetch_add(&counters->allocatedBytes, (unsigned long long) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->allocationCount, 1ULL, __ATOMIC_RELAXED);
+}
+
+static void countFree(ModHeapTracker::Counters* counters, void* ptr) {
+    __atomic_fetch_add(&counters->freedBytes, (unsigned long long) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->freeCount, 1ULL, __ATOMIC_RELAXED);
+}
+
+// the hooks are only reachable from the tracked libraries, so the caller is found using the return address; if it
+// can't be found (eg. the library is just being removed), the call goes straight to the allocator
+
+void* ModHeapTracker::mallocHook(size_t size) {
+    TrackedLibrary* lib = findLibrary(__builtin_return_address(0));
+    if (lib == nullptr)
+        return malloc(size);
+    void* ret = lib->mallocOrg(size);
+    if (ret != nullptr)
+        countAllocation(lib->counters, ret);
+    return ret;
+}
+
+void* ModHeapTracker::callocHook(size_t count, size_t size) {
+    TrackedLibrary* lib = findLibrary(__builtin_return_address(0));
+    if (lib == nullptr)
+        return calloc(count, size);
+    void* ret = lib->callocOrg(count, size);
+    if (ret != nullptr)
+        countAllocation(lib->counters, ret);
+    return ret;
+}
+
+void* ModHeapTracker::reallocHook(void* ptr, size_t size) {
+    TrackedLibrary* lib = findLibrary(__builtin_return_address(0));
+    if (lib == nullptr)
+        return realloc(ptr, size);
+    size_t oldSize = (ptr != nullptr ? malloc_usable_size(ptr) : 0);
+    void* ret = lib->reallocOrg(ptr, size);
+    if (ret == nullptr && size != 0) // failed, the old block is still allocated
+        return ret;
+    if (ptr != nullptr) {
+        __atomic_fetch_add(&lib->counters->freedBytes, (unsigned long long) oldSize, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lib->counters->freeCount, 1ULL, __ATOMIC_RELAXED);
+    }
+    if (ret != nullptr)
+        countAllocation(lib->counters, ret);
+    return ret;
+}
+
+void ModHeapTracker::freeHook(void* ptr) {
+    TrackedLibrary* lib = findLibrary(__builtin_return_address(0));
+    if (lib == nullptr) {
+        free(ptr);
+        return;
+    }
+    if (ptr != nullptr)
+        countFree(lib->counters, ptr);
+    lib->freeOrg(ptr);
+}
+
+void ModHeapTracker::publishLibraries() {
+    std::sort(libraries.begin(), libraries.end(), [](TrackedLibrary* a, TrackedLibrary* b) {
+        return a->start < b->start;
+    });
+    LibraryList* list = (LibraryList*) malloc(sizeof(LibraryList) + libraries.size() * sizeof(TrackedLibrary*));
+    list->count = libraries.size();
+    for (size_t i = 0; i < libraries.size(); i++)
+        list->libraries[i] = libraries[i];
+    __atomic_store_n(&trackedLibraries, list, __ATOMIC_RELEASE);
+}
+
+void ModHeapTracker::addLibrary(Mod* mod, void* lib) {
+    std::lock_guard<std::mutex> lock (mutex);
+    for (TrackedLibrary* l : libraries) {
+        if (l->lib == lib)
+            return;
+    }
+    Counters*& counters = modCounters[mod];
+    if (counters == nullptr)
+        counters = new Counters();
+    soinfo* si = (soinfo*) lib;
+    TrackedLibrary* l = new TrackedLibrary();
+    l->start = (size_t) si->base;
+    l->end = (size_t) si->base + si->size;
+    l->lib = lib;
+    l->counters = counters;
+    // the library has to be findable before any of its slots point to the hooks
+    libraries.push_back(l);
+    publishLibraries();
+    struct {
+        const char* name;
+        void* hook;
+        void** org;
+    } functions[] = {
+            {"malloc", (void*) mallocHook, (void**) &l->mallocOrg},
+            {"calloc", (void*) callocHook, (void**) &l->callocOrg},
+            {"realloc", (void*) reallocHook, (void**) &l->reallocOrg},
+            {"free", (void*) freeHook, (void**) &l->freeOrg}
+    };
+    for (auto const& f : functions) {
+        try {
+            l->hooks.push_back(hookManager.hookImports(lib, hookManager.internSymbol(f.name), f.hook, f.org));
+        } catch (std::exception&) {
+            // the library doesn't use this function
+        }
+    }
+}
+
+void ModHeapTracker::removeLibrary(void* lib) {
+    std::lock_guard<std::mutex> lock (mutex);
+    for (auto it = libraries.begin(); it != libraries.end(); it++) {
+        if ((*it)->lib != lib)
+            continue;
+        for (HookManager::HookInfo* hook : (*it)->hooks)
+            hookManager.unhook(hook);
+        libraries.erase(it);
+        publishLibraries();
+        return;
+    }
+}
+
+void ModHeapTracker::removeAllLibraries() {
+    std::lock_guard<std::mutex> lock (mutex);
+    for (TrackedLibrary* l : libraries) {
+        for (HookManager::HookInfo* hook : l->hooks)
+            hookManager.unhook(hook);
+    }
+    libraries.clear();
+    publishLibraries();
+}
+
+std::vector<std::pair<Mod*, ModHeapTracker::Counters>> ModHeapTracker::getCounters() {
+    std::lock_guard<std::mutex> lock (mutex);
+    std::vector<std::pair<Mod*, Counters>> ret;
+    for (auto const& p : modCounters) {
+        Counters c;
+        c.allocatedBytes = __atomic_load_n(&p.second->allocatedBytes, __ATOMIC_RELAXED);
+        c.freedBytes = __atomic_load_n(&p.second->freedBytes, __ATOMIC_RELAXED);
+        c.allocationCount = __atomic_load_n(&p.second->allocationCount, __ATOMIC_RELAXED);
+        c.freeCount = __atomic_load_n(&p.second->freeCount, __ATOMIC_RELAXED);
+        ret.push_back({p.first, c});
+    }
+    return ret;
+}
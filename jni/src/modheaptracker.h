@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "hookmanager.h"
+
+namespace tml {
+
+class Mod;
+
+/**
+ * Counts the heap allocations made by the code of each mod, by hooking malloc, calloc, realloc and free only for the
+ * calls made from the mods' libraries (the game's own allocations don't go through the hooks at all). The memory is
+ * still allocated by the regular allocator, so it can be freed by any library; however frees made outside of the mod
+ * aren't seen, so the live size of a mod handing its allocations over to the game is overestimated.
+ */
+class ModHeapTracker {
+
+public:
+    struct Counters {
+        unsigned long long allocatedBytes = 0, freedBytes = 0;
+        unsigned long long allocationCount = 0, freeCount = 0;
+    };
+
+private:
+    struct TrackedLibrary {
+        size_t start, end;
+        void* lib;
+        Counters* counters;
+        void* (*mallocOrg)(size_t) = nullptr;
+        void* (*callocOrg)(size_t, size_t) = nullptr;
+        void* (*reallocOrg)(void*, size_t) = nullptr;
+        void (*freeOrg)(void*) = nullptr;
+        std::vector<HookManager::HookInfo*> hooks;
+    };
+    struct LibraryList {
+        size_t count;
+        TrackedLibrary* libraries[1]; // sorted by the start address
+    };
+
+    // read by the hooks without any locking; the old lists and the removed libraries are never freed, as a thread
+    // might still be using them
+    static LibraryList* trackedLibraries;
+
+    HookManager& hookManager;
+    std::mutex mutex;
+    std::map<Mod*, Counters*> modCounters; // kept across mod reloads
+    std::vector<TrackedLibrary*> libraries;
+
+    void publishLibraries();
+
+    static TrackedLibrary* findLibrary(void* address);
+
+    static void* mallocHook(size_t size);
+    static void* callocHook(size_t count, size_t size);
+    static void* reallocHook(void* ptr, size_t size);
+    static void freeHook(void* ptr);
+
+public:
+    ModHeapTracker(HookManager& hookManager) : hookManager(hookManager) { }
+
+    /**
+     * Starts counting the allocations made by the specified library of the specified mod.
+     */
+    void addLibrary(Mod* mod, void* lib);
+
+    /**
+     * Stops counting the allocations of the specified library; this must be called before the library is unloaded.
+     */
+    void removeLibrary(void* lib);
+
+    void removeAllLibraries();
+
+    /**
+     * Returns the current counters of all of the mods which have been tracked so far.
+     */
+    std::vector<std::pair<Mod*, Counters>> getCounters();
+
+};
+
+}
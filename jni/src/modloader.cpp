@@ -5,9 +5,21 @@
 #include <tml/mod.h>
 #include <sys/stat.h>
 #include <iterator>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <functional>
 #include "fileutil.h"
 #include "nativemodcodeloader.h"
 #include "hookmanager.h"
+#include "modheaptracker.h"
+#include "modmanifestindex.h"
+#include "tracing.h"
 
 using namespace tml;
 
@@ -16,37 +28,107 @@ const char* ModLoader::MODLOADER_PKGID = "io.mrarm:tml";
 ModLoader::ModLoader(std::string internalDir) : internalDir(internalDir), loaderLog(this, "TML") {
     if (internalDir[internalDir.length() - 1] != '/')
         internalDir += "/";
+    this->internalDir = internalDir;
+    if (FileUtil::fileExists(internalDir + "trace_startup"))
+        Tracing::setEnabled(true);
     mkdir(internalDir.c_str(), 0700);
     mkdir((internalDir + "mods/").c_str(), 0700);
     modDataStoragePath = internalDir + "mod_data/";
     mkdir(modDataStoragePath.c_str(), 0700);
     loaders["native"] = {nullptr,
                          std::unique_ptr<ModCodeLoader>(new NativeModCodeLoader(*this, internalDir + "cache/native"))};
-    hookManager = new HookManager(this);
+    hookManager = new HookManager(this, internalDir + "cache/");
+    manifestIndex = new ModManifestIndex(internalDir + "cache/manifest");
 }
 
 ModLoader::~ModLoader() {
+    delete manifestIndex;
+    delete heapTracker;
     delete hookManager;
 }
 
 Mod* ModLoader::findMod(std::string id, const ModDependencyVersionList& versions) const {
-    if (mods.count(id) <= 0)
+    auto modIt = mods.find(id);
+    if (modIt == mods.end())
         return nullptr;
+    auto const& modVersions = modIt->second;
+    // the versions are sorted, so the newest one in a range is the one right before the first version above it
     Mod* newestMod = nullptr;
     ModVersion newestModVersion;
-    for (const auto& mod : mods.at(id)) {
-        if (versions.contains(mod.first)) {
-            if (newestMod == nullptr || mod.first > newestModVersion) {
-                newestMod = mod.second.get();
-                newestModVersion = mod.first;
-            }
+    for (const auto& range : versions.list) {
+        auto it = modVersions.upper_bound(range.to);
+        if (it == modVersions.begin())
+            continue;
+        --it;
+        if (it->first < range.from)
+            continue;
+        if (newestMod == nullptr || it->first > newestModVersion) {
+            newestMod = it->second.get();
+            newestModVersion = it->first;
         }
     }
     return newestMod;
 }
 
+bool ModLoader::resolveDependencies(Mod& mod, std::map<Mod*, int>& state, std::vector<Mod*>& stack) {
+    // 0 - not visited yet, 1 - being resolved (on the stack), 2 - resolved, 3 - failed
+    int& s = state[&mod];
+    if (s == 1) {
+        std::string cycle;
+        for (auto it = std::find(stack.begin(), stack.end(), &mod); it != stack.end(); it++)
+            cycle += (*it)->getMeta().getId() + " -> ";
+        loaderLog.error("Mods depend on each other in a cycle: %s%s", cycle.c_str(), mod.getMeta().getId().c_str());
+        return false;
+    }
+    if (s != 0)
+        return (s == 2);
+    s = 1;
+    stack.push_back(&mod);
+    bool resolved = true;
+    for (auto const& dep : mod.getMeta().getDependencies()) {
+        if (dep.mod == nullptr || !resolveDependencies(*dep.mod, state, stack))
+            resolved = false;
+    }
+    stack.pop_back();
+    s = (resolved ? 2 : 3);
+    mod.meta.dependenciesResolved = resolved;
+    return resolved;
+}
+
 void ModLoader::addMod(std::unique_ptr<ModResources> resources) {
-    std::unique_ptr<Mod> mod(new Mod(this, std::move(resources)));
+    registerMod(std::unique_ptr<Mod>(new Mod(this, std::move(resources))));
+}
+
+std::unique_ptr<Mod> ModLoader::createMod(std::string const& path, bool isDirectory) {
+    TraceScope trace ("createMod");
+    long long size, modifyTime;
+    bool indexable = ModManifestIndex::getSourceInfo(path, isDirectory, size, modifyTime);
+    if (indexable) {
+        std::unique_ptr<ModMeta> meta = manifestIndex->find(path, size, modifyTime);
+        if (meta) {
+            // the mod hasn't changed, so it's only going to be opened once its files are needed
+            std::unique_ptr<ModResources> res(new DeferredModResources([path, isDirectory]() -> ModResources* {
+                if (isDirectory)
+                    return new DirectoryModResources(path);
+                return new ZipModResources(path);
+            }));
+            trace.setModId(meta->getId());
+            return std::unique_ptr<Mod>(new Mod(this, std::move(res), *meta));
+        }
+    }
+    std::unique_ptr<ModResources> res;
+    if (isDirectory)
+        res.reset(new DirectoryModResources(path));
+    else
+        res.reset(new ZipModResources(path));
+    std::unique_ptr<Mod> mod (new Mod(this, std::move(res)));
+    trace.setModId(mod->getMeta().getId());
+    if (indexable)
+        manifestIndex->put(path, size, modifyTime, mod->getMeta());
+    return mod;
+}
+
+void ModLoader::registerMod(std::unique_ptr<Mod> mod) {
     if (mods.count(mod->getMeta().getId()) > 0) {
         Mod* secondMod = mods.at(mod->getMeta().getId()).begin()->second.get();
         if (secondMod->getMeta().getVersion() == mod->getMeta().getVersion())
@@ -61,31 +143,65 @@ void ModLoader::addMod(std::unique_ptr<ModResources> resources) {
 }
 
 void ModLoader::addModFromDirectory(std::string path) {
+    TraceScope trace ("addModFromDirectory");
     loaderLog.info("Loading mod from directory: %s", path.c_str());
-    std::unique_ptr<ModResources> res(new DirectoryModResources(path));
-    addMod(std::move(res));
+    registerMod(createMod(path, true));
 }
 
 void ModLoader::addModFromZip(std::string path) {
+    TraceScope trace ("addModFromZip");
     loaderLog.info("Loading mod from zip: %s", path.c_str());
-    std::unique_ptr<ModResources> res(new ZipModResources(path));
-    addMod(std::move(res));
+    registerMod(createMod(path, false));
 }
 
 void ModLoader::addModFromAssets(std::string path) {
+    TraceScope trace ("addModFromAssets");
     loaderLog.info("Loading mod from assets: %s", path.c_str());
     std::unique_ptr<ModResources> res(new AndroidAssetsModResources(assetManager, path, assetsLastModifyTime));
     addMod(std::move(res));
 }
 
 void ModLoader::addAllModsFromDirectory(std::string path) {
+    TraceScope trace ("addAllModsFromDirectory");
     loaderLog.info("Loading all mod from directory: %s", path.c_str());
+    std::vector<FileUtil::DirectoryFile> files;
     for (auto& f : FileUtil::getFilesIn(path)) {
-        if (f.isDirectory) {
-            addModFromDirectory(path + "/" + f.name);
-        } else if (f.name.length() >= 4 && memcmp(&f.name[f.name.length() - 4], ".tbp", 4) == 0) {
-            addModFromZip(path + "/" + f.name);
+        if (f.isDirectory || (f.name.length() >= 4 && memcmp(&f.name[f.name.length() - 4], ".tbp", 4) == 0))
+            files.push_back(f);
+    }
+    // the order of the directory listing isn't defined; sort it so that the errors are always reported the same way
+    std::sort(files.begin(), files.end(), [](FileUtil::DirectoryFile const& a, FileUtil::DirectoryFile const& b) {
+        return a.name < b.name;
+    });
+
+    // opening the archives and parsing the metadata is independent for each mod, so do it on multiple threads
+    std::vector<std::unique_ptr<Mod>> parsedMods(files.size());
+    std::vector<std::exception_ptr> errors(files.size());
+    std::atomic<size_t> nextFile (0);
+    auto worker = [this, &path, &files, &parsedMods, &errors, &nextFile]() {
+        for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+            try {
+                parsedMods[i] = createMod(path + "/" + files[i].name, files[i].isDirectory);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
         }
+    };
+    size_t threadCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 2U), files.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (std::thread& t : threads)
+        t.join();
+
+    // register the mods in order, stopping at the first error just like loading them one by one would
+    for (size_t i = 0; i < files.size(); i++) {
+        loaderLog.info("Loading mod from %s: %s", files[i].isDirectory ? "directory" : "zip",
+                       (path + "/" + files[i].name).c_str());
+        if (errors[i])
+            std::rethrow_exception(errors[i]);
+        registerMod(std::move(parsedMods[i]));
     }
 }
 
@@ -104,16 +220,139 @@ std::vector<Mod*> ModLoader::getMods() const {
     return std::move(ret);
 }
 
-bool ModLoader::loadMod(Mod& mod) {
-    if (!mod.getMeta().areAllDependenciesResolved()) {
-        loaderLog.error("Not loading mod %s - failed to resolve some dependencies", mod.getMeta().getId().c_str());
-        return false;
+std::vector<Mod*> ModLoader::getLoadOrder(std::vector<Mod*> const& mods) {
+    // the length of the longest chain of mods depending on each mod (including itself); loading the mods with the
+    // longest chains first lets the most of the other mods become loadable early
+    std::map<Mod*, std::vector<Mod*>> dependents;
+    std::map<Mod*, size_t> remainingDeps;
+    for (Mod* mod : mods) {
+        remainingDeps[mod];
+        for (const auto& dep : mod->getMeta().getDependencies()) {
+            if (dep.mod->isLoaded())
+                continue;
+            dependents[dep.mod].push_back(mod);
+            remainingDeps[mod]++;
+        }
     }
-    for (const auto& dep : mod.getMeta().getDependencies())
-        if (!dep.mod->isLoaded())
-            loadMod(*dep.mod);
-    mod.load();
-    return true;
+    std::map<Mod*, size_t> criticalPath;
+    std::function<size_t (Mod*)> getCriticalPath = [&](Mod* mod) -> size_t {
+        auto it = criticalPath.find(mod);
+        if (it != criticalPath.end())
+            return it->second;
+        criticalPath[mod] = 1; // guards against dependency cycles
+        size_t longest = 0;
+        for (Mod* dependent : dependents[mod])
+            longest = std::max(longest, getCriticalPath(dependent));
+        return (criticalPath[mod] = longest + 1);
+    };
+
+    auto compare = [&](Mod* a, Mod* b) {
+        size_t pa = getCriticalPath(a), pb = getCriticalPath(b);
+        if (pa != pb)
+            return pa < pb;
+        return a->getMeta().getId() > b->getMeta().getId();
+    };
+    std::priority_queue<Mod*, std::vector<Mod*>, decltype(compare)> ready (compare);
+    for (auto const& p : remainingDeps) {
+        if (p.second == 0)
+            ready.push(p.first);
+    }
+    std::vector<Mod*> order;
+    while (!ready.empty()) {
+        Mod* mod = ready.top();
+        ready.pop();
+        order.push_back(mod);
+        for (Mod* dependent : dependents[mod]) {
+            if (--remainingDeps[dependent] == 0)
+                ready.push(dependent);
+        }
+    }
+    return order;
+}
+
+void ModLoader::loadMods(std::vector<Mod*> const& mods) {
+    std::vector<Mod*> order = getLoadOrder(mods);
+    if (order.size() != mods.size())
+        loaderLog.error("Not loading %i mods - they depend on each other in a cycle",
+                        (int) (mods.size() - order.size()));
+
+    // the code is prepared (extracted and verified) on worker threads in the load order, while this thread loads
+    // (dlopens) each mod as soon as it is prepared, as only that has to happen in the dependency order; the code
+    // loaders registered by the mods being loaded don't exist yet, so their code is fully handled by loadCode
+    std::vector<std::vector<std::pair<ModCodeLoader*, std::string>>> codeToPrepare(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        for (const ModCode& code : order[i]->getMeta().getCode()) {
+            ModCodeLoader* codeLoader = getCodeLoader(code.loaderName);
+            if (codeLoader != nullptr)
+                codeToPrepare[i].push_back({codeLoader, code.codePath});
+        }
+    }
+    std::mutex preparedMutex;
+    std::condition_variable preparedCond;
+    std::vector<bool> prepared(order.size(), false);
+    // an exception escaping a worker thread would terminate the game, so it is kept until the mod's turn to be loaded
+    // comes, and the mod is then skipped
+    std::vector<std::exception_ptr> errors(order.size());
+    std::atomic<size_t> nextMod (0);
+    auto worker = [&]() {
+        for (size_t i = nextMod++; i < order.size(); i = nextMod++) {
+            try {
+                for (auto const& code : codeToPrepare[i]) {
+                    if (!code.first->prepareCode(*order[i], code.second))
+                        loaderLog.error("Failed to prepare mod code '%s' from the mod %s", code.second.c_str(),
+                                        order[i]->getMeta().getId().c_str());
+                }
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock (preparedMutex);
+            prepared[i] = true;
+            preparedCond.notify_all();
+        }
+    };
+    size_t threadCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 2U), order.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threadCount; i++)
+        threads.push_back(std::thread(worker));
+    // the mods which failed to be prepared and the ones depending on them; the unloaded mods are removed afterwards, so
+    // none of their dependents may be loaded (and keep a pointer to them)
+    std::set<Mod*> failed;
+    for (size_t i = 0; i < order.size(); i++) {
+        {
+            std::unique_lock<std::mutex> lock (preparedMutex);
+            preparedCond.wait(lock, [&prepared, i]() { return (bool) prepared[i]; });
+        }
+        Mod* mod = order[i];
+        if (errors[i]) {
+            try {
+                std::rethrow_exception(errors[i]);
+            } catch (std::exception& e) {
+                loaderLog.error("Failed to prepare the code of the mod %s: %s", mod->getMeta().getId().c_str(),
+                                e.what());
+            } catch (...) {
+                loaderLog.error("Failed to prepare the code of the mod %s", mod->getMeta().getId().c_str());
+            }
+            mod->meta.dependenciesResolved = false;
+            failed.insert(mod);
+            continue;
+        }
+        // the dependencies come earlier in the load order, so this covers the whole chain of dependents
+        const ModDependency* failedDep = nullptr;
+        for (const auto& dep : mod->getMeta().getDependencies()) {
+            if (failed.count(dep.mod) > 0)
+                failedDep = &dep;
+        }
+        if (failedDep != nullptr) {
+            loaderLog.error("Not loading mod %s - its dependency %s failed to load", mod->getMeta().getId().c_str(),
+                            failedDep->mod->getMeta().getId().c_str());
+            mod->meta.dependenciesResolved = false;
+            failed.insert(mod);
+            continue;
+        }
+        mod->load();
+    }
+    for (std::thread& t : threads)
+        t.join();
 }
 
 void ModLoader::initMod(Mod &mod) {
@@ -127,7 +366,73 @@ void ModLoader::initMod(Mod &mod) {
     }
 }
 
+void ModLoader::addToInitOrder(Mod& mod, std::vector<Mod*>& order, std::set<Mod*>& visited) {
+    if (visited.count(&mod) > 0)
+        return;
+    visited.insert(&mod);
+    for (const auto& dep : mod.getMeta().getDependencies())
+        addToInitOrder(*dep.mod, order, visited);
+    order.push_back(&mod);
+}
+
+void ModLoader::applyQueuedHooks(std::vector<Mod*> const& mods) {
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<HookManager::HookRequest> requests;
+    for (Mod* mod : mods) {
+        for (auto& hk : mod->queuedHooks) {
+            void* lib = mcpeLib;
+            if (hk.lib.length() > 0)
+                lib = dlopen(hk.lib.c_str(), RTLD_LAZY);
+            requests.push_back({lib, hk.sym, hk.func, hk.org, mod});
+        }
+    }
+    if (requests.size() > 0) {
+        std::vector<HookManager::HookInfo*> hooks = hookManager->hookMany(requests);
+
+        // only keep the hooks that failed in the queue, Mod::init will report them
+        size_t i = 0;
+        for (Mod* mod : mods) {
+            std::vector<Mod::QueuedHook> failedHooks;
+            for (auto& hk : mod->queuedHooks) {
+                if (hooks[i++] == nullptr)
+                    failedHooks.push_back(hk);
+            }
+            mod->queuedHooks = std::move(failedHooks);
+        }
+    }
+
+    size_t observerCount = 0;
+    // a single batch, so that each observed symbol gets its observer array and dispatcher hook written only once
+    hookManager->beginWriteBatch();
+    for (Mod* mod : mods) {
+        std::vector<Mod::QueuedObserver> failedObservers;
+        for (auto& ob : mod->queuedObservers) {
+            void* lib = mcpeLib;
+            if (ob.lib.length() > 0)
+                lib = dlopen(ob.lib.c_str(), RTLD_LAZY);
+            try {
+                hookManager->addObserver(lib, ob.sym, {ob.callback, ob.post, mod, {ob.dispatch, ob.original,
+                                                                                    ob.observers}});
+                observerCount++;
+            } catch (std::exception& e) {
+                loaderLog.error("Failed to add an observer of %s: %s", hookManager->getSymbolName(ob.sym).c_str(),
+                                e.what());
+                failedObservers.push_back(ob);
+            }
+        }
+        mod->queuedObservers = std::move(failedObservers);
+    }
+    hookManager->endWriteBatch();
+    if (requests.size() == 0 && observerCount == 0)
+        return;
+    loaderLog.trace("Installed %i hooks and %i observers in %i ms", (int) requests.size(), (int) observerCount,
+                    (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - startTime).count());
+}
+
 void ModLoader::resolveDependenciesAndLoad() {
+    TraceScope trace ("resolveDependenciesAndLoad");
+    TraceScope resolveTrace ("resolveDependencies");
     for (const auto& modVersions : mods) {
         for (const auto& mod : modVersions.second) {
             for (auto& dep : mod.second->meta.dependencies) {
@@ -146,40 +451,270 @@ void ModLoader::resolveDependenciesAndLoad() {
             }
         }
     }
+    // every mod is resolved only once, no matter how many mods depend on it
+    std::map<Mod*, int> resolveState;
+    std::vector<Mod*> resolveStack;
+    for (const auto& modVersions : mods) {
+        for (const auto& mod : modVersions.second)
+            resolveDependencies(*mod.second, resolveState, resolveStack);
+    }
+    resolveTrace.end();
 
     loaderLog.trace("Initializing hook system...");
+    TraceScope hookSystemTrace ("initHookSystem");
     mcpeLib = dlopen("libminecraftpe.so", RTLD_LAZY);
     if (mcpeLib == nullptr)
         throw std::runtime_error("Failed to dlopen libminecraftpe.so");
     hookManager->updateLoadedLibs();
+    hookManager->enableLibraryTracking();
+    hookSystemTrace.end();
 
     loaderLog.trace("Loading mod code...");
+    TraceScope loadTrace ("loadModCode");
+    std::vector<Mod*> modsToLoad;
     for (auto& modVersions : mods) {
         for (auto it = modVersions.second.begin(); it != modVersions.second.end();) {
-            if (!it->second->isLoaded() && !loadMod(*it->second)) {
+            if (!it->second->isLoaded() && !it->second->getMeta().areAllDependenciesResolved()) {
+                loaderLog.error("Not loading mod %s - failed to resolve some dependencies",
+                                it->second->getMeta().getId().c_str());
                 // remove it from the list
                 it = modVersions.second.erase(it);
                 continue;
             }
+            if (!it->second->isLoaded())
+                modsToLoad.push_back(it->second.get());
             it++;
         }
     }
+    loadMods(modsToLoad);
+    for (auto& modVersions : mods) {
+        for (auto it = modVersions.second.begin(); it != modVersions.second.end();) {
+            if (!it->second->isLoaded())
+                it = modVersions.second.erase(it);
+            else
+                it++;
+        }
+    }
+    loadTrace.end();
 
     loaderLog.trace("Updating hook system with the mod libraries...");
     hookManager->updateLoadedLibs();
+    if (heapTracker != nullptr) {
+        for (Mod* mod : getMods())
+            trackModHeap(*mod);
+    }
+    // sampled once all of the mod libraries are mapped, so that it covers the same libraries as the sample after
+    // hooking does
+    size_t unprotectedPagesBefore = hookManager->getUnprotectedPageCount();
+    size_t privateDirtyBefore = hookManager->getLibrariesPrivateDirtyBytes();
 
-    loaderLog.trace("Initializing mods...");
+    loaderLog.trace("Installing mod hooks...");
+    TraceScope hooksTrace ("installHooks");
+    std::vector<Mod*> initOrder;
+    std::set<Mod*> visited;
     for (const auto& modVersions : mods) {
         for (const auto& mod : modVersions.second) {
-            initMod(*mod.second);
+            addToInitOrder(*mod.second, initOrder, visited);
         }
     }
+    applyQueuedHooks(initOrder);
+    hooksTrace.end();
+
+    loaderLog.trace("Initializing mods...");
+    TraceScope initTrace ("initMods");
+    for (Mod* mod : initOrder) {
+        initMod(*mod);
+    }
+    initTrace.end();
+    // the game threads start once the mods are loaded, and could be running a function while its entry is written
+    hookManager->lockInlinePatching();
+
+    // debug rather than trace, as the trace messages are compiled out of the release builds
+    loaderLog.debug("Hooking made %i pages temporarily writable; private dirty memory of libraries: %i kB before, "
+                    "%i kB after", (int) (hookManager->getUnprotectedPageCount() - unprotectedPagesBefore),
+                    (int) (privateDirtyBefore / 1024), (int) (hookManager->getLibrariesPrivateDirtyBytes() / 1024));
+    loaderLog.debug("Symbol resolution cache: %i hits, %i misses", (int) hookManager->resolveCacheHits,
+                    (int) hookManager->resolveCacheMisses);
+
+    TraceScope saveTrace ("saveCaches");
+    hookManager->saveCaches();
+    if (!manifestIndex->save())
+        loaderLog.warn("Failed to save the mod manifest index");
+    saveTrace.end();
+
+    trace.end();
+    if (Tracing::isEnabled()) {
+        if (!Tracing::writeTrace(internalDir + "startup_trace.json"))
+            loaderLog.warn("Failed to write the startup trace");
+        // the trace only covers the startup; the spans of the runtime symbol lookups and rescans would pile up forever
+        Tracing::setEnabled(false);
+    }
+}
+
+void ModLoader::setTracingEnabled(bool enabled) {
+    Tracing::setEnabled(enabled);
 }
 
 void ModLoader::updateHookManagerLoadedLibs() {
     hookManager->updateLoadedLibs();
 }
 
+void ModLoader::reloadMod(Mod& mod) {
+    auto startTime = std::chrono::steady_clock::now();
+    loaderLog.info("Reloading mod %s", mod.getMeta().getId().c_str());
+    hookManager->removeObservers(&mod);
+    hookManager->detachHooks(&mod);
+
+    // drop everything that points into the mod's code
+    {
+        std::lock_guard<std::recursive_mutex> lock (logPrintersMutex);
+        for (auto it = logPrinters.begin(); it != logPrinters.end(); ) {
+            if (it->first == &mod)
+                it = logPrinters.erase(it);
+            else
+                it++;
+        }
+    }
+    for (auto it = loaders.begin(); it != loaders.end(); ) {
+        if (it->second.first == &mod)
+            it = loaders.erase(it);
+        else
+            it++;
+    }
+    std::vector<void*> nativeLibs;
+    for (auto& code : mod.loadedCode) {
+        void* lib = code->getNativeLibrary();
+        if (lib != nullptr)
+            nativeLibs.push_back(lib);
+    }
+    if (heapTracker != nullptr) {
+        for (void* lib : nativeLibs)
+            heapTracker->removeLibrary(lib);
+    }
+    mod.unload();
+    for (void* lib : nativeLibs)
+        hookManager->releaseLibrary(lib);
+
+    mod.load();
+    hookManager->updateLoadedLibs();
+    if (heapTracker != nullptr)
+        trackModHeap(mod);
+    try {
+        mod.init();
+    } catch (std::exception& e) {
+        loaderLog.error("Failed to init mod %s: %s", mod.getMeta().getId().c_str(), e.what());
+    }
+    hookManager->removePlaceholders(&mod);
+    hookManager->saveCaches();
+    loaderLog.info("Reloaded mod %s in %i ms", mod.getMeta().getId().c_str(), (int) std::chrono::duration_cast<
+            std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count());
+}
+
+void ModLoader::trackModHeap(Mod& mod) {
+    for (auto& code : mod.loadedCode) {
+        void* lib = code->getNativeLibrary();
+        if (lib == nullptr)
+            continue;
+        try {
+            heapTracker->addLibrary(&mod, lib);
+        } catch (std::exception& e) {
+            loaderLog.error("Failed to track the heap of mod %s: %s", mod.getMeta().getId().c_str(), e.what());
+        }
+    }
+}
+
+void ModLoader::setHeapTrackingEnabled(bool enabled) {
+    if (enabled && heapTracker == nullptr) {
+        heapTracker = new ModHeapTracker(*hookManager);
+        for (Mod* mod : getMods()) {
+            if (mod->isLoaded())
+                trackModHeap(*mod);
+        }
+    } else if (!enabled && heapTracker != nullptr) {
+        heapTracker->removeAllLibraries();
+        delete heapTracker;
+        heapTracker = nullptr;
+    }
+}
+
+std::vector<ModHeapStats> ModLoader::getModHeapStats() const {
+    std::vector<ModHeapStats> ret;
+    if (heapTracker == nullptr)
+        return ret;
+    for (auto const& p : heapTracker->getCounters()) {
+        ModHeapStats stats;
+        stats.mod = p.first;
+        stats.allocatedBytes = p.second.allocatedBytes;
+        stats.freedBytes = p.second.freedBytes;
+        stats.allocationCount = p.second.allocationCount;
+        stats.freeCount = p.second.freeCount;
+        ret.push_back(stats);
+    }
+    return ret;
+}
+
+void ModLoader::setHookInstrumentationEnabled(bool enabled) {
+    hookManager->setInstrumentationEnabled(enabled);
+}
+
+std::vector<ModHookStats> ModLoader::getHookStats() const {
+    std::vector<ModHookStats> ret;
+    hookManager->forEachHook([this, &ret](HookManager::HookInfo const& hook) {
+        if (hook.instrumentation == nullptr)
+            return;
+        ModHookStats stats;
+        stats.mod = hook.owner;
+        stats.symbol = hookManager->getSymbolName(hook.symbol->libNameDesc.name);
+        HookCallStats const& s = hook.instrumentation->stats;
+        stats.callCount = __atomic_load_n(&s.callCount, __ATOMIC_RELAXED);
+        stats.totalTimeNs = __atomic_load_n(&s.totalTimeNs, __ATOMIC_RELAXED);
+        for (int i = 0; i < ModHookStats::HISTOGRAM_BUCKETS; i++)
+            stats.latencyHistogram[i] = __atomic_load_n(&s.histogram[i], __ATOMIC_RELAXED);
+        ret.push_back(std::move(stats));
+    });
+    return ret;
+}
+
+std::vector<ModHookStats> ModLoader::getModHookStats() const {
+    std::map<Mod*, ModHookStats> perMod;
+    for (const ModHookStats& stats : getHookStats()) {
+        ModHookStats& total = perMod[stats.mod];
+        total.mod = stats.mod;
+        total.callCount += stats.callCount;
+        total.totalTimeNs += stats.totalTimeNs;
+        for (int i = 0; i < ModHookStats::HISTOGRAM_BUCKETS; i++)
+            total.latencyHistogram[i] += stats.latencyHistogram[i];
+    }
+    std::vector<ModHookStats> ret;
+    for (auto& p : perMod)
+        ret.push_back(std::move(p.second));
+    return ret;
+}
+
+static std::string formatLatencyHistogram(ModHookStats const& stats) {
+    std::string ret;
+    for (int i = 0; i < ModHookStats::HISTOGRAM_BUCKETS; i++) {
+        if (stats.latencyHistogram[i] == 0)
+            continue;
+        char buf[48];
+        snprintf(buf, sizeof(buf), "%s<2^%ins:%llu", (ret.length() > 0 ? " " : ""), i + 1, stats.latencyHistogram[i]);
+        ret += buf;
+    }
+    return ret;
+}
+
+void ModLoader::dumpHookStats() {
+    for (const ModHookStats& stats : getModHookStats()) {
+        loaderLog.info("Hooks of %s: %llu calls, %llu us total", (stats.mod != nullptr ?
+                       stats.mod->getMeta().getId().c_str() : "(unknown)"), stats.callCount, stats.totalTimeNs / 1000);
+    }
+    for (const ModHookStats& stats : getHookStats()) {
+        loaderLog.info("  %s [%s]: %llu calls, %llu us total; %s", stats.symbol.c_str(), (stats.mod != nullptr ?
+                       stats.mod->getMeta().getId().c_str() : "(unknown)"), stats.callCount, stats.totalTimeNs / 1000,
+                       formatLatencyHistogram(stats).c_str());
+    }
+}
+
 ModCodeLoader* ModLoader::getCodeLoader(std::string name) {
     if (loaders.count(name) > 0)
         return loaders.at(name).second.get();
@@ -187,6 +722,7 @@ ModCodeLoader* ModLoader::getCodeLoader(std::string name) {
 }
 
 void ModLoader::registerLogPrinter(Mod& ownerMod, std::unique_ptr<LogPrinter> printer) {
+    std::lock_guard<std::recursive_mutex> lock (logPrintersMutex);
     logPrinters.push_back({&ownerMod, std::move(printer)});
 }
 
@@ -214,6 +750,7 @@ void ModLoader::printLogMessage(LogLevel level, const std::string& tag, const ch
     }
     __android_log_vprint(androidLogLevel, tag.c_str(), msg, va);
 
+    std::lock_guard<std::recursive_mutex> lock (logPrintersMutex);
     for (auto& printer : logPrinters) {
         printer.second->printLogMessage(level, tag, msg, va);
     }
@@ -0,0 +1,133 @@
+#include "modmanifestindex.h"
+
+#include <sys/stat.h>
+#include "cachefile.h"
+
+using namespace tml;
+
+static bool readVersion(CacheFileReader& reader, ModVersion& version) {
+    return reader.read(version.major) && reader.read(version.minor) && reader.read(version.patch);
+}
+
+static void writeVersion(CacheFileWriter& writer, ModVersion const& version) {
+    writer.write(version.major);
+    writer.write(version.minor);
+    writer.write(version.patch);
+}
+
+ModManifestIndex::ModManifestIndex(std::string const& path) : path(path) {
+    CacheFileReader reader(path, MANIFEST_INDEX_VERSION);
+    if (!reader.isValid())
+        return;
+    unsigned int count;
+    if (!reader.read(count))
+        return;
+    for (unsigned int i = 0; i < count; i++) {
+        std::string modPath;
+        Entry entry;
+        entry.meta.reset(new ModMeta());
+        ModMeta& meta = *entry.meta;
+        unsigned int codeCount, depCount;
+        if (!reader.readString(modPath) || !reader.read(entry.size) || !reader.read(entry.modifyTime) ||
+            !reader.readString(meta.name) || !reader.readString(meta.desc) || !reader.readString(meta.author) ||
+            !reader.readString(meta.id) || !readVersion(reader, meta.version) ||
+            !reader.read(meta.supportsMultiversion) || !reader.read(codeCount))
+            return;
+        meta.code.resize(codeCount);
+        for (ModCode& code : meta.code) {
+            if (!reader.readString(code.loaderName) || !reader.readString(code.codePath))
+                return;
+        }
+        if (!reader.read(depCount))
+            return;
+        meta.dependencies.resize(depCount);
+        for (ModDependency& dep : meta.dependencies) {
+            unsigned int versionCount;
+            if (!reader.readString(dep.id) || !reader.read(versionCount))
+                return;
+            for (unsigned int j = 0; j < versionCount; j++) {
+                ModVersion from, to;
+                if (!readVersion(reader, from) || !readVersion(reader, to))
+                    return;
+                dep.version.list.push_back(ModDependencyVersion(from, to));
+            }
+        }
+        entries[modPath] = std::move(entry);
+    }
+}
+
+bool ModManifestIndex::getSourceInfo(std::string const& path, bool isDirectory, long long& size,
+                                     long long& modifyTime) {
+    struct stat buf;
+    if (stat((isDirectory ? path + "/package.yaml" : path).c_str(), &buf) != 0)
+        return false;
+    size = buf.st_size;
+    modifyTime = buf.st_mtime;
+    return true;
+}
+
+std::unique_ptr<ModMeta> ModManifestIndex::find(std::string const& path, long long size, long long modifyTime) {
+    std::lock_guard<std::mutex> lock (mutex);
+    auto it = entries.find(path);
+    if (it == entries.end() || it->second.size != size || it->second.modifyTime != modifyTime)
+        return std::unique_ptr<ModMeta>();
+    it->second.used = true;
+    return std::unique_ptr<ModMeta>(new ModMeta(*it->second.meta));
+}
+
+void ModManifestIndex::put(std::string const& path, long long size, long long modifyTime, ModMeta const& meta) {
+    std::lock_guard<std::mutex> lock (mutex);
+    Entry& entry = entries[path];
+    entry.size = size;
+    entry.modifyTime = modifyTime;
+    entry.meta.reset(new ModMeta(meta));
+    entry.used = true;
+    dirty = true;
+}
+
+bool ModManifestIndex::save() {
+    std::lock_guard<std::mutex> lock (mutex);
+    // drop the mods which weren't found anymore
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        if (!it->second.used) {
+            it = entries.erase(it);
+            dirty = true;
+        } else {
+            it++;
+        }
+    }
+    if (!dirty)
+        return true;
+    CacheFileWriter writer(path, MANIFEST_INDEX_VERSION);
+    writer.write((unsigned int) entries.size());
+    for (auto const& e : entries) {
+        ModMeta const& meta = *e.second.meta;
+        writer.writeString(e.first);
+        writer.write(e.second.size);
+        writer.write(e.second.modifyTime);
+        writer.writeString(meta.name);
+        writer.writeString(meta.desc);
+        writer.writeString(meta.author);
+        writer.writeString(meta.id);
+        writeVersion(writer, meta.version);
+        writer.write(meta.supportsMultiversion);
+        writer.write((unsigned int) meta.code.size());
+        for (ModCode const& code : meta.code) {
+            writer.writeString(code.loaderName);
+            writer.writeString(code.codePath);
+        }
+        writer.write((unsigned int) meta.dependencies.size());
+        for (ModDependency const& dep : meta.dependencies) {
+            writer.writeString(dep.id);
+            writer.write((unsigned int) dep.version.list.size());
+            for (ModDependencyVersion const& v : dep.version.list) {
+                writeVersion(writer, v.from);
+                writeVersion(writer, v.to);
+            }
+        }
+    }
+    if (!writer.commit())
+        return false;
+    dirty = false;
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tml/modmeta.h>
+
+namespace tml {
+
+/**
+ * Keeps the parsed metadata of the mods found in the previous runs, so that the mods which haven't changed since then
+ * don't have to be opened (and their package.yaml parsed) on startup. The entries are keyed by the path of the mod's
+ * zip or directory, and are only used if the size and the modification time of the zip (or of the directory's
+ * package.yaml) are still the same.
+ */
+class ModManifestIndex {
+
+private:
+    static const int MANIFEST_INDEX_VERSION = 1;
+
+    struct Entry {
+        long long size, modifyTime;
+        std::unique_ptr<ModMeta> meta;
+        bool used = false; // the entries which weren't used in this run are dropped on save
+    };
+
+    std::string path;
+    std::mutex mutex; // the mods are being added from multiple threads
+    std::map<std::string, Entry> entries;
+    bool dirty = false;
+
+public:
+    ModManifestIndex(std::string const& path);
+
+    /**
+     * Gets the size and the modification time used to check if the mod at the specified path has changed. Returns
+     * false if the mod's zip or package.yaml can't be found.
+     */
+    static bool getSourceInfo(std::string const& path, bool isDirectory, long long& size, long long& modifyTime);
+
+    /**
+     * Returns the stored metadata of the mod at the specified path, or null if it isn't known or the mod has changed.
+     */
+    std::unique_ptr<ModMeta> find(std::string const& path, long long size, long long modifyTime);
+
+    /**
+     * Stores the metadata of the mod at the specified path.
+     */
+    void put(std::string const& path, long long size, long long modifyTime, ModMeta const& meta);
+
+    /**
+     * Writes the index to the disk (if it has changed). Returns false on failure.
+     */
+    bool save();
+
+};
+
+}
@@ -3,6 +3,7 @@
 #include <tml/mod.h>
 #include <cstdlib>
 #include <yaml.h>
+#include "tracing.h"
 
 using namespace tml;
 
@@ -79,6 +80,7 @@ int yamlCppStreamWrapper(void* data, unsigned char* buffer, size_t size, size_t*
     }
 
 ModMeta::ModMeta(std::istream& ins) {
+    TraceScope trace ("parseModMeta");
     yaml_parser_t parser;
     if (!yaml_parser_initialize(&parser))
         throw std::runtime_error("Failed to initialize YAML Parser");
@@ -176,16 +178,9 @@ ModMeta::ModMeta(std::istream& ins) {
     }
     yaml_document_delete(&document);
     yaml_parser_delete(&parser);
+    trace.setModId(id);
 }
 
 ModMeta::ModMeta(ModResources& resources) : ModMeta(*resources.open("package.yaml")) {
     //
 }
-
-bool ModMeta::areAllDependenciesResolved() const {
-    for (auto& dep : dependencies) {
-        if (dep.mod == nullptr || !dep.mod->getMeta().areAllDependenciesResolved())
-            return false;
-    }
-    return true;
-}
\ No newline at end of file
@@ -192,4 +192,11 @@ AAssetStreamBuffer::int_type AAssetStreamBuffer::underflow() {
            ? std::char_traits<char>::eof()
            : std::char_traits<char>::to_int_type(*this->gptr());
 
-}
\ No newline at end of file
+}
+
+ModResources& DeferredModResources::get() {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (!resources)
+        resources.reset(factory());
+    return *resources;
+}
@@ -2,17 +2,46 @@
 
 #include <tml/mod.h>
 #include <cstring>
+#include <pthread.h>
 
 using namespace tml;
 
-Mod* StaticHookManager::currentMod = nullptr;
+static pthread_key_t currentModKey;
+static pthread_once_t currentModKeyOnce = PTHREAD_ONCE_INIT;
+
+static void createCurrentModKey() {
+    pthread_key_create(&currentModKey, nullptr);
+}
+
+Mod* StaticHookManager::getCurrentMod() {
+    pthread_once(&currentModKeyOnce, createCurrentModKey);
+    return (Mod*) pthread_getspecific(currentModKey);
+}
+
+void StaticHookManager::setCurrentMod(Mod* mod) {
+    pthread_once(&currentModKeyOnce, createCurrentModKey);
+    pthread_setspecific(currentModKey, mod);
+}
 
 void StaticHookManager::registerHook(const char* sym, void* hook, void** org) {
+    Mod* currentMod = getCurrentMod();
+    const char* ls = strchr(sym, ':');
+    if (ls != nullptr) {
+        std::string lib(sym, ls - sym);
+        currentMod->queueHook(lib, ls + 1, strlen(ls + 1), hook, org);
+    } else {
+        currentMod->queueHook(std::string(), sym, strlen(sym), hook, org);
+    }
+}
+
+void StaticHookManager::registerObserver(const char* sym, void* dispatch, void** original,
+                                         HookObserverArray** observers, void* observer, bool post) {
+    Mod* currentMod = getCurrentMod();
     const char* ls = strchr(sym, ':');
     if (ls != nullptr) {
         std::string lib(sym, ls - sym);
-        currentMod->queueHook(lib, std::string(ls + 1), hook, org);
+        currentMod->queueObserver(lib, ls + 1, strlen(ls + 1), dispatch, original, observers, observer, post);
     } else {
-        currentMod->queueHook(std::string(), std::string(sym), hook, org);
+        currentMod->queueObserver(std::string(), sym, strlen(sym), dispatch, original, observers, observer, post);
     }
 }
\ No newline at end of file
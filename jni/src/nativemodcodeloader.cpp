@@ -6,6 +6,7 @@
 #include <tml/mod.h>
 #include <tml/modloader.h>
 #include "fileutil.h"
+#include "tracing.h"
 
 using namespace tml;
 
@@ -22,6 +23,7 @@ bool NativeModCodeLoader::extractIfNeeded(Mod& mod, std::string path, std::strin
     // Check if we need to extract the file (it generally will be handled by the hub)
     if (FileUtil::fileExists(localPath) && FileUtil::fileExists(infoPath)) {
         // Some version has already been extracted; check it
+        TraceScope trace ("checkExtractedCode", mod.getMeta().getId());
         FILE* file = fopen(infoPath.c_str(), "r");
         int version = -1;
         fread(&version, sizeof(int), 1, file);
@@ -37,6 +39,7 @@ bool NativeModCodeLoader::extractIfNeeded(Mod& mod, std::string path, std::strin
                 }
                 // calculate SHA512
                 char sha512a[64];
+                TraceScope hashTrace ("hashModCode", mod.getMeta().getId());
                 if (FileUtil::calculateSHA512(*mod.getResources().open(path), sha512a) &&
                     FileUtil::calculateSHA512(localPath, sha512) &&
                     memcmp(sha512, modInfo.sha512, sizeof(sha512)) == 0 &&
@@ -48,13 +51,16 @@ bool NativeModCodeLoader::extractIfNeeded(Mod& mod, std::string path, std::strin
         }
     }
     // extract the file!
+    TraceScope hashTrace ("hashModCode", mod.getMeta().getId());
     calculatedSha512 = FileUtil::calculateSHA512(*mod.getResources().open(path), sha512);
+    hashTrace.end();
     if (!calculatedSha512) {
         loader.getLog().fatal("Failed to load native mod code '%s' from mod %s (%s)", path.c_str(),
                               mod.getMeta().getName().c_str(), mod.getMeta().getId().c_str());
         return false;
     }
     {
+        TraceScope trace ("extractModCode", mod.getMeta().getId());
         std::ofstream file(localPath, std::ofstream::binary);
         auto stream = mod.getResources().open(path);
         char buffer[8 * 1024];
@@ -67,6 +73,7 @@ bool NativeModCodeLoader::extractIfNeeded(Mod& mod, std::string path, std::strin
     }
     // verify that the file was successfully extracted
     {
+        TraceScope trace ("verifyExtractedCode", mod.getMeta().getId());
         char sha512a[64];
         if (!FileUtil::calculateSHA512(localPath, sha512a) || memcmp(sha512, sha512a, sizeof(sha512)) != 0) {
             loader.getLog().fatal("Failed to extract the file (checksum mismatch)");
@@ -90,7 +97,7 @@ bool NativeModCodeLoader::extractIfNeeded(Mod& mod, std::string path, std::strin
     return true;
 }
 
-std::unique_ptr<ModLoadedCode> NativeModCodeLoader::loadCode(Mod& mod, std::string path) {
+bool NativeModCodeLoader::findCodePath(Mod& mod, std::string& path) {
     // possible formats: native/ARCH/libPATH.so native/ARCH/PATH.so native/ARCH/PATH
 #ifdef __i386
     std::string prefix = "native/x86/";
@@ -106,17 +113,47 @@ std::unique_ptr<ModLoadedCode> NativeModCodeLoader::loadCode(Mod& mod, std::stri
     else {
         loader.getLog().error("Cannot find native mod code '%s' from mod %s (%s)", path.c_str(),
                               mod.getMeta().getName().c_str(), mod.getMeta().getId().c_str());
-        return std::unique_ptr<ModLoadedCode>();
+        return false;
     }
-    loader.getLog().info("Loading native mod code '%s' from mod %s (%s)", path.c_str(), mod.getMeta().getName().c_str(),
-                         mod.getMeta().getId().c_str());
-    std::string localPath =
-            libsPrivatePath + "/" + mod.getMeta().getId() + "/" + mod.getMeta().getVersion().toString() + "/" + path;
+    return true;
+}
+
+std::string NativeModCodeLoader::getLocalPath(Mod& mod, std::string const& path) {
+    return libsPrivatePath + "/" + mod.getMeta().getId() + "/" + mod.getMeta().getVersion().toString() + "/" + path;
+}
+
+bool NativeModCodeLoader::prepareCode(Mod& mod, std::string path) {
+    if (!findCodePath(mod, path))
+        return false;
+    std::string localPath = getLocalPath(mod, path);
     FileUtil::createDirs(FileUtil::getParent(localPath));
     if (!extractIfNeeded(mod, path, localPath))
+        return false;
+    std::lock_guard<std::mutex> lock (preparedMutex);
+    preparedPaths.insert(localPath);
+    return true;
+}
+
+std::unique_ptr<ModLoadedCode> NativeModCodeLoader::loadCode(Mod& mod, std::string path) {
+    if (!findCodePath(mod, path))
         return std::unique_ptr<ModLoadedCode>();
+    loader.getLog().info("Loading native mod code '%s' from mod %s (%s)", path.c_str(), mod.getMeta().getName().c_str(),
+                         mod.getMeta().getId().c_str());
+    std::string localPath = getLocalPath(mod, path);
+    bool prepared;
+    {
+        std::lock_guard<std::mutex> lock (preparedMutex);
+        prepared = (preparedPaths.erase(localPath) > 0);
+    }
+    if (!prepared) {
+        FileUtil::createDirs(FileUtil::getParent(localPath));
+        if (!extractIfNeeded(mod, path, localPath))
+            return std::unique_ptr<ModLoadedCode>();
+    }
     loader.getLog().trace("Loading native mod code: %s", localPath.c_str());
+    TraceScope trace ("dlopen", mod.getMeta().getId());
     void* lib = dlopen(localPath.c_str(), RTLD_LAZY);
+    trace.end();
     if (lib == nullptr) {
         loader.getLog().error("Failed to load native mod code: %s", dlerror());
         return std::unique_ptr<ModLoadedCode>();
@@ -126,8 +163,10 @@ std::unique_ptr<ModLoadedCode> NativeModCodeLoader::loadCode(Mod& mod, std::stri
 
 NativeModLoadedCode::NativeModLoadedCode(Mod& mod, void* lib) : ModLoadedCode(mod), lib(lib) {
     int (* initSym)(Mod&) = (int (*)(Mod&)) dlsym(lib, "tml_preinit");
-    if (initSym != nullptr)
+    if (initSym != nullptr) {
+        TraceScope trace ("tml_preinit", mod.getMeta().getId());
         initSym(mod);
+    }
 }
 
 void NativeModLoadedCode::init() {
@@ -136,6 +175,14 @@ void NativeModLoadedCode::init() {
         initSym(mod);
 }
 
+void NativeModLoadedCode::unload() {
+    int (* unloadSym)(Mod&) = (int (*)(Mod&)) dlsym(lib, "tml_unload");
+    if (unloadSym != nullptr)
+        unloadSym(mod);
+    dlclose(lib);
+    lib = nullptr;
+}
+
 void NativeModLoadedCode::onMinecraftInitialized(MinecraftClient* minecraft) {
     int (* mcSym)(Mod&, MinecraftClient*) = (int (*)(Mod&, MinecraftClient*)) dlsym(lib, "tml_mcinit");
     if (mcSym != nullptr)
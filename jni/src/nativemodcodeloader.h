@@ -2,6 +2,8 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <mutex>
 #include <tml/modcodeloader.h>
 
 namespace tml {
@@ -19,6 +21,8 @@ public:
     virtual ~NativeModLoadedCode() { }
     virtual void init();
     virtual void onMinecraftInitialized(MinecraftClient* minecraft);
+    virtual void unload();
+    virtual void* getNativeLibrary() const { return lib; }
 
 };
 
@@ -27,6 +31,11 @@ class NativeModCodeLoader : public ModCodeLoader {
 private:
     ModLoader& loader;
     std::string libsPrivatePath;
+    std::mutex preparedMutex;
+    std::set<std::string> preparedPaths; // local paths which have been extracted by prepareCode
+
+    bool findCodePath(Mod& mod, std::string& path);
+    std::string getLocalPath(Mod& mod, std::string const& path);
 
 public:
     NativeModCodeLoader(ModLoader& loader, std::string libsPrivatePath) : loader(loader),
@@ -34,6 +43,8 @@ public:
 
     virtual ~NativeModCodeLoader() { }
 
+    virtual bool prepareCode(Mod& mod, std::string path);
+
     virtual std::unique_ptr<ModLoadedCode> loadCode(Mod& mod, std::string path);
 
     bool extractIfNeeded(Mod& mod, std::string path, std::string localPath);
@@ -0,0 +1,27 @@
+#include "symbolnametable.h"
+
+using namespace tml;
+
+size_t SymbolNameTable::hash(const char* str, size_t length) {
+    // FNV-1a
+    size_t h = (sizeof(size_t) == 8 ? (size_t) 14695981039346656037ULL : (size_t) 2166136261U);
+    size_t prime = (sizeof(size_t) == 8 ? (size_t) 1099511628211ULL : (size_t) 16777619U);
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char) str[i];
+        h *= prime;
+    }
+    return h;
+}
+
+SymbolId SymbolNameTable::intern(const char* str, size_t length) {
+    Key key = {str, length, hash(str, length)};
+    auto it = ids.find(key);
+    if (it != ids.end())
+        return it->second;
+    SymbolId id = (SymbolId) names.size();
+    names.push_back(std::string(str, length));
+    hashes.push_back(key.hash);
+    key.str = names.back().data();
+    ids[key] = id;
+    return id;
+}
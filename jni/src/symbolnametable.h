@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <unordered_map>
+
+namespace tml {
+
+typedef unsigned int SymbolId;
+
+/**
+ * Assigns stable ids to symbol names, so they can be used as cheap keys in the lookup tables. The hash of every name is
+ * computed only once and looking up a name that has already been interned doesn't allocate any memory.
+ */
+class SymbolNameTable {
+
+private:
+    struct Key {
+        const char* str;
+        size_t length;
+        size_t hash;
+
+        bool operator==(Key const& k) const {
+            return (hash == k.hash && length == k.length && memcmp(str, k.str, length) == 0);
+        }
+    };
+    struct KeyHash {
+        std::size_t operator()(Key const& k) const { return k.hash; }
+    };
+
+    std::deque<std::string> names; // a deque never moves its elements, so the keys can point to the strings
+    std::vector<size_t> hashes;
+    std::unordered_map<Key, SymbolId, KeyHash> ids;
+
+public:
+    static size_t hash(const char* str, size_t length);
+
+    SymbolId intern(const char* str, size_t length);
+
+    SymbolId intern(const char* str) { return intern(str, strlen(str)); }
+
+    std::string const& getName(SymbolId id) const { return names[id]; }
+
+    size_t getHash(SymbolId id) const { return hashes[id]; }
+
+};
+
+}
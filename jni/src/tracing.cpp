@@ -0,0 +1,83 @@
+#include "tracing.h"
+
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "fileutil.h"
+
+using namespace tml;
+
+struct TraceSpan {
+    const char* name;
+    std::string modId;
+    long long startTime, endTime;
+    int threadId;
+};
+
+static std::mutex spansMutex;
+static std::vector<TraceSpan> spans;
+
+bool Tracing::enabled = false;
+
+void Tracing::setEnabled(bool enabled) {
+    Tracing::enabled = enabled;
+}
+
+long long Tracing::getTime() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracing::addSpan(const char* name, std::string const& modId, long long startTime, long long endTime) {
+    if (!enabled) // a span started before tracing got disabled
+        return;
+    int threadId = (int) syscall(__NR_gettid);
+    std::lock_guard<std::mutex> lock (spansMutex);
+    spans.push_back({name, modId, startTime, endTime, threadId});
+}
+
+static void writeJsonString(FILE* file, const char* str) {
+    fputc('"', file);
+    for ( ; *str != '\0'; str++) {
+        unsigned char c = (unsigned char) *str;
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+bool Tracing::writeTrace(std::string const& path) {
+    FileUtil::createDirs(FileUtil::getParent(path));
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+        return false;
+    int pid = (int) getpid();
+    std::lock_guard<std::mutex> lock (spansMutex);
+    fputs("{\"traceEvents\":[", file);
+    for (size_t i = 0; i < spans.size(); i++) {
+        TraceSpan const& span = spans[i];
+        fputs(i > 0 ? ",\n" : "\n", file);
+        fputs("{\"name\":", file);
+        writeJsonString(file, span.name);
+        fprintf(file, ",\"cat\":\"tml\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%i,\"tid\":%i", span.startTime,
+                span.endTime - span.startTime, pid, span.threadId);
+        if (!span.modId.empty()) {
+            fputs(",\"args\":{\"mod\":", file);
+            writeJsonString(file, span.modId.c_str());
+            fputc('}', file);
+        }
+        fputc('}', file);
+    }
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", file);
+    bool success = (fflush(file) == 0 && !ferror(file));
+    fclose(file);
+    std::vector<TraceSpan>().swap(spans);
+    return success;
+}
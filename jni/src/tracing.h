@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+
+namespace tml {
+
+/**
+ * Collects the timing spans of the loading phases, which can be written out in the Chrome trace event format (and
+ * opened in chrome://tracing or Perfetto). When disabled, a span only costs a check of the enabled flag.
+ */
+class Tracing {
+
+private:
+    static bool enabled;
+
+public:
+    static bool isEnabled() { return enabled; }
+
+    static void setEnabled(bool enabled);
+
+    /**
+     * Records a span, unless tracing is disabled; the times are in microseconds (of the steady clock).
+     */
+    static void addSpan(const char* name, std::string const& modId, long long startTime, long long endTime);
+
+    /**
+     * Returns the current time in microseconds, as used for the spans.
+     */
+    static long long getTime();
+
+    /**
+     * Writes all of the spans recorded so far to the specified file as JSON, and discards them. Returns false on
+     * failure.
+     */
+    static bool writeTrace(std::string const& path);
+
+};
+
+/**
+ * Records a span lasting from the creation of this object until it is destroyed (or until end() is called). The name
+ * must be a string literal.
+ */
+class TraceScope {
+
+private:
+    const char* name;
+    std::string modId;
+    long long startTime;
+
+public:
+    TraceScope(const char* name) : name(Tracing::isEnabled() ? name : nullptr) {
+        if (this->name != nullptr)
+            startTime = Tracing::getTime();
+    }
+
+    TraceScope(const char* name, std::string const& modId) : TraceScope(name) {
+        if (this->name != nullptr)
+            this->modId = modId;
+    }
+
+    ~TraceScope() { end(); }
+
+    /**
+     * Sets the mod the span is related to, for the spans started before the mod is known.
+     */
+    void setModId(std::string const& modId) {
+        if (name != nullptr)
+            this->modId = modId;
+    }
+
+    void end() {
+        if (name != nullptr)
+            Tracing::addSpan(name, modId, startTime, Tracing::getTime());
+        name = nullptr;
+    }
+
+};
+
+}